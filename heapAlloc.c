@@ -24,13 +24,69 @@
 //                   search, be sure to include Web URLs and description of 
 //                   of any information you find.
 //////////////////////////// 80 columns wide /////////////////////////////////// 
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/file.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <malloc.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <stddef.h>
+#if defined(__x86_64__) && defined(__GLIBC__) && \
+        (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 35))
+#include <sys/rseq.h>
+#define HAVE_RSEQ
+#endif
+
+/*
+ * libheap.so is built from two copies of this file. heapAlloc.o is the
+ * heap of initHeap and the rest of heapAlloc.h. heapMalloc.o is built
+ * with HEAP_MALLOC and adds the malloc family on a heap of its own. All
+ * of the state below is static, so that copy has every bit of it to
+ * itself, and its public names are renamed and hidden so the two never
+ * meet. Whatever the C library allocates first, initHeap and the options
+ * before it stay the program's.
+ */
+#ifdef HEAP_MALLOC
+#define initHeap                 malloc_initHeap
+#define allocHeap                malloc_allocHeap
+#define freeHeap                 malloc_freeHeap
+#define reallocHeap              malloc_reallocHeap
+#define allocHeapAligned         malloc_allocHeapAligned
+#define dumpMem                  malloc_dumpMem
+#define allocHeapBatch           malloc_allocHeapBatch
+#define freeHeapBatch            malloc_freeHeapBatch
+#define heapSetOption            malloc_heapSetOption
+#define heapTrim                 malloc_heapTrim
+#define arenaCreate              malloc_arenaCreate
+#define arenaAlloc               malloc_arenaAlloc
+#define arenaReset               malloc_arenaReset
+#define arenaDestroy             malloc_arenaDestroy
+#define heapCreate               malloc_heapCreate
+#define heapAllocFrom            malloc_heapAllocFrom
+#define heapFreeTo               malloc_heapFreeTo
+#define heapDestroy              malloc_heapDestroy
+#define heapOpen                 malloc_heapOpen
+#define heapClose                malloc_heapClose
+#define heapOffsetOf             malloc_heapOffsetOf
+#define heapPointerAt            malloc_heapPointerAt
+#define heapSetRoot              malloc_heapSetRoot
+#define heapGetRoot              malloc_heapGetRoot
+#define heapShare                malloc_heapShare
+#define heapDetach               malloc_heapDetach
+#define heapStart                malloc_heapStart
+#define allocsize                malloc_allocsize
+#pragma GCC visibility push(hidden)
+#endif
 #include "heapAlloc.h"
  
 /*
@@ -38,9 +94,10 @@
  * It also serves as the footer for each free block but only containing size.
  */
 typedef struct blockHeader {           
-    int size_status;
+    size_t size_status;
     /*
-    * Size of the block is always a multiple of 8.
+    * Size of the block is always a multiple of 8, or of 16 in 64-bit builds
+    * where the header itself takes 8 bytes. Payloads are aligned the same.
     * Size is stored in all block headers and free block footers.
     *
     * Status is stored only in headers using the two least significant bits.
@@ -51,9 +108,13 @@ typedef struct blockHeader {
     *   Bit1 => second last bit 
     *   Bit1 == 0 => previous block is free
     *   Bit1 == 1 => previous block is allocated
+    *
+    *   Bit2 => third last bit, only used in headers of allocated blocks
+    *   Bit2 == 1 => block has a mapping of its own, see allocDirect
     * 
     * End Mark: 
-    *  The end of the available memory is indicated using a size_status of 1.
+    *  The end of the available memory is indicated using a size of 0 with
+    *  Bit0 set, i.e. a size_status of 1 or 3 depending on the last block.
     * 
     * Examples:
     * 
@@ -71,284 +132,3867 @@ typedef struct blockHeader {
     */
 } blockHeader;         
 
-/* Global variable - DO NOT CHANGE. It should always point to the first block,
- * i.e., the block at the lowest address.
- */
-blockHeader *heapStart = NULL;     
+/*
+ * Free blocks are linked into doubly linked lists, one per size class.
+ * The links live in the payload of the free block right after its header,
+ * so a free block must be big enough for header, links and footer.
+ */
+typedef struct freeLinks {
+    blockHeader *next;
+    blockHeader *prev;
+} freeLinks;
+
+/*
+ * Under best-fit, free blocks of at least SMALL_LIMIT bytes are kept in a
+ * red-black tree ordered by size and then address instead of in lists.
+ * The node takes the place of the links. When a minimum size block
+ * absorbs its neighbor, the neighbor's old header falls on the last word
+ * of the node, so that word is a pointer, whose a-bit is always clear,
+ * and never the color, or a second free of the absorbed block would find
+ * it still allocated.
+ */
+typedef struct treeNode {
+    size_t red;
+    blockHeader *left;
+    blockHeader *right;
+    blockHeader *parent;
+} treeNode;
+
+#define A_BIT           1
+#define P_BIT           2
+#define M_BIT           4
+#define SIZE_MASK       (~(size_t)7)
+
+/* Block sizes and payload addresses are multiples of ALIGNMENT, which is
+ * 8 in 32-bit builds and 16 in 64-bit builds.
+ */
+#define ALIGNMENT       (2 * sizeof(blockHeader))
+#define ALIGN_SHIFT     (sizeof(blockHeader) == 8 ? 4 : 3)
+#define ALIGN_UP(n)     (((n) + ALIGNMENT - 1) & ~(ALIGNMENT - 1))
+
+#define MIN_BLOCK_SIZE  ALIGN_UP(2 * sizeof(blockHeader) + sizeof(freeLinks))
+
+/*
+ * Size classes: blocks below SMALL_LIMIT get one bin per multiple of
+ * ALIGNMENT, so every block in such a bin fits a request that maps to it.
+ * Larger blocks are binned by power of two, split into SUB_BINS ranges
+ * each. Non-empty bins are tracked in a two level bitmap, a bit per bin in
+ * binmap and a bit per word of binmap in binmapWords, so finding the next
+ * non-empty bin takes two find-first-set operations at most.
+ */
+#define SMALL_BINS      64
+#define SMALL_SHIFT     (6 + ALIGN_SHIFT)
+#define SMALL_LIMIT     ((size_t)SMALL_BINS << ALIGN_SHIFT)
+#define SUB_SHIFT       3
+#define SUB_BINS        (1 << SUB_SHIFT)
+#define SIZE_BITS       (8 * (int)sizeof(size_t))
+#define NBINS           (SMALL_BINS + SUB_BINS * (SIZE_BITS - SMALL_SHIFT))
+#define BINMAP_WORDS    ((NBINS + 31) / 32)     // at most 32
+
+/*
+ * Slabs. Requests of up to slabLimit bytes can be served from slabs
+ * instead: SLAB_SIZE aligned pages cut into equal objects of one size
+ * class, with no header per object and a bitmap of the free ones. The slab
+ * holding an object is found by masking its address. Every slab keeps the
+ * size of a segment descriptor free in front of its own header, which in
+ * the first slab of a chunk holds the descriptor of the whole chunk.
+ */
+#define SLAB_SHIFT      14
+#define SLAB_SIZE       ((size_t)1 << SLAB_SHIFT)
+#define SLAB_MAX        512
+#define SLAB_CLASSES    ((SLAB_MAX >> ALIGN_SHIFT) + 1)
+#define SLAB_MAP_BITS   (8 * (int)sizeof(unsigned long))
+#define SLAB_MAP_WORDS  ((int)(SLAB_SIZE / ALIGNMENT) / SLAB_MAP_BITS)
+
+typedef struct slabHeader {
+    struct heapArena *arena;      // arena the slab was cut for
+    struct slabHeader *next;      // neighbors on the arena's list of slabs
+    struct slabHeader *prev;      // with free objects of the same class
+    unsigned int objSize;
+    unsigned int objCount;
+    unsigned int freeCount;
+    unsigned long freeMap[SLAB_MAP_WORDS];  // bit set for each free object
+} slabHeader;
+
+/*
+ * Buddy engine. With HEAP_ENGINE_BUDDY an arena is a pool of power of two
+ * blocks of BUDDY_MIN bytes and up, each aligned to its size within the
+ * pool, so the buddy of a block is found by flipping the bit of its size
+ * in its offset. Blocks carry no header or footer. Per order one bitmap
+ * marks the blocks that are free and another the ones split in two; the
+ * order of an allocated block is recovered from the split bits. Free
+ * blocks of each order are linked through their first bytes.
+ */
+#define BUDDY_SHIFT     (ALIGN_SHIFT + 1)
+#define BUDDY_MIN       ((size_t)1 << BUDDY_SHIFT)
+#define BUDDY_ORDERS    (SIZE_BITS - BUDDY_SHIFT)
+#define LONG_BITS       (8 * (int)sizeof(unsigned long))
+
+typedef struct buddyLinks {
+    struct buddyLinks *next;
+    struct buddyLinks *prev;
+} buddyLinks;
+
+typedef struct buddyPool {
+    char *base;                   // offset 0, the start of the arena
+    size_t size;                  // a multiple of BUDDY_MIN
+    buddyLinks *lists[BUDDY_ORDERS];  // free blocks by order
+    size_t nonEmpty;              // bit set for each order with free blocks
+    unsigned long *freeBits[BUDDY_ORDERS];
+    unsigned long *splitBits[BUDDY_ORDERS];  // from order 1 up
+} buddyPool;
+
+/*
+ * Thread-safe mode keeps a per-thread cache of ready-to-use blocks for each
+ * block size below CACHE_LIMIT, one LIFO list per multiple of ALIGNMENT. Cached
+ * blocks stay marked allocated in the heap so neither coalescing nor other
+ * threads ever touch them, which lets the owning thread use them without
+ * taking an arena lock. Lists are refilled and flushed CACHE_BATCH blocks at a
+ * time. Slab objects are cached the same way on CACHE_SLAB_LISTS of their
+ * own, one per slab class.
+ */
+#define CACHE_CLASSES   SMALL_BINS
+#define CACHE_LIMIT     ((size_t)CACHE_CLASSES << ALIGN_SHIFT)
+#define CACHE_LISTS     (CACHE_CLASSES + SLAB_CLASSES)
+#define CACHE_BATCH     16
+#define CACHE_MAX       (2 * CACHE_BATCH)
+
+typedef struct cacheEntry {
+    struct cacheEntry *next;
+    struct threadCache *owner;    // cache holding the block, NULL in use
+} cacheEntry;
+
+typedef struct threadCache {
+    cacheEntry *lists[CACHE_LISTS];
+    int counts[CACHE_LISTS];
+    int registered;               // thread exit destructor is armed
+} threadCache;
+
+/*
+ * With HEAP_OPT_CPU_CACHE the thread caches give way to one cache per CPU,
+ * so cached memory grows with the cores instead of the threads. Each list
+ * is a stack of up to CPU_SLOTS entries in an array, pushed and popped in
+ * restartable sequences. The kernel sends a thread that is preempted,
+ * migrated or signalled inside one back to its start, and only the final
+ * store of the new count commits it, so whoever runs on a CPU owns its
+ * cache for the length of a push or pop without atomics or locks.
+ * Cached entries carry CPU_OWNER as their owner mark.
+ */
+#define CPU_SLOTS       CACHE_MAX
+#define CPU_OWNER       ((threadCache*)&cpuCaches)
+
+typedef struct cpuCache {
+    unsigned int counts[CACHE_LISTS];
+    void *slots[CACHE_LISTS][CPU_SLOTS];
+} __attribute__((aligned(64))) cpuCache;
+
+/*
+ * Quick lists hold freed arena blocks of less than QUICK_LIMIT bytes
+ * without coalescing them, one LIFO list per multiple of ALIGNMENT. Parked
+ * blocks stay marked allocated, so an allocation of the same size takes
+ * one back without splitting anything. Once an arena's quick lists would
+ * hold more than HEAP_OPT_QUICK_BUDGET bytes, or nothing else fits a
+ * request, they are all released in one consolidation pass.
+ */
+#define QUICK_CLASSES   SMALL_BINS
+#define QUICK_LIMIT     ((size_t)QUICK_CLASSES << ALIGN_SHIFT)
+
+typedef struct quickEntry {
+    struct quickEntry *next;
+    struct heapArena *arena;      // arena holding the block, NULL in use
+} quickEntry;
+
+/*
+ * In thread-safe mode a thread that frees an arena block of another arena
+ * than its own pushes it onto that arena's remote free queue with a single
+ * compare-and-swap instead of taking the arena lock. The queue has many
+ * producers and one consumer at a time, the thread holding the lock, so
+ * the next allocation from the arena takes the whole queue with an
+ * exchange and releases it in one batch. Queued blocks use the quick list
+ * entry layout and carry the same arena mark.
+ */
+
+/*
+ * A segment is one contiguous block chain ending in its own end mark.
+ * Every arena starts out with the segment initHeap gave it and, when
+ * HEAP_OPT_GROW_SIZE is set, maps more segments as it fills up. A grown
+ * segment keeps its descriptor at the start of its own mapping, followed
+ * by its blocks. Chunks that slabs are cut from are described by segments
+ * without blocks.
+ */
+typedef struct heapSegment {
+    struct heapArena *arena;      // arena the blocks belong to
+    struct heapSegment *next;     // next segment of the same arena
+    blockHeader *start;           // first block, the lowest address, or
+                                  // NULL in a chunk of slabs
+    size_t size;                  // bytes from start up to the end mark
+} heapSegment;
+
+/* Offset of the first block header in a grown segment, chosen so that
+ * payloads stay aligned.
+ */
+#define SEGMENT_HEADER  \
+    (ALIGN_UP(sizeof(heapSegment) + sizeof(blockHeader)) - sizeof(blockHeader))
+
+/* Offset of the first object in a slab.
+ */
+#define SLAB_OBJECTS    ALIGN_UP(sizeof(heapSegment) + sizeof(slabHeader))
+
+/*
+ * Grown segments are mapped CHUNK_SIZE aligned and sized, so each chunk
+ * belongs to at most one of them. segmentMap is a two level radix table
+ * from chunk number to segment, which lets freeHeap find the segment of
+ * any pointer without searching. Leaves are mapped on first use.
+ */
+#define CHUNK_SHIFT     20
+#define CHUNK_SIZE      (1 << CHUNK_SHIFT)
+#define ADDRESS_BITS    (sizeof(void*) == 8 ? 48 : 32)
+#define MAP_ROOT_BITS   ((ADDRESS_BITS - CHUNK_SHIFT) / 2)
+#define MAP_LEAF_BITS   (ADDRESS_BITS - CHUNK_SHIFT - MAP_ROOT_BITS)
+
+/* Largest payload allocHeap will try to serve, small enough that rounding
+ * it up to a block or a mapping cannot overflow.
+ */
+#define MAX_REQUEST     ((SIZE_MAX >> 1) - CHUNK_SIZE)
+
+/*
+ * An arena is an independent heap with its own segments, its own free
+ * lists and its own lock. initHeap carves its region into numArenas equal
+ * arenas laid out back to back, so the arena owning a pointer in that
+ * region is found by dividing its offset into the region by arenaSpan.
+ * Threads are spread over the arenas round-robin or by the CPU they run on.
+ */
+#define MAX_ARENAS      64
+
+typedef struct heapArena {
+    pthread_mutex_t lock;
+    heapSegment first;            // segment carved out by initHeap, the
+                                  // head of the arena's segment list
+    blockHeader *bins[NBINS];     // heads of the free lists
+    unsigned int binmap[BINMAP_WORDS];  // bit set for each non-empty bin
+    unsigned int binmapWords;     // bit set for each non-zero binmap word
+    blockHeader *rover;           // free block the next next-fit search
+                                  // starts at
+    blockHeader *sizeTree;        // root of the best-fit tree
+    int useSizeTree;              // large free blocks go into sizeTree,
+                                  // fixed when the arena is laid out
+    blockHeader *wilderness;      // free block at the end of a segment
+                                  // that allocBlock bumps through
+    quickEntry *quick[QUICK_CLASSES];   // parked blocks by size
+    quickEntry *remoteFrees;      // blocks freed by other arenas' threads,
+                                  // pushed without the lock
+    size_t quickBytes;            // bytes parked on the quick lists
+    size_t freedSinceTrim;        // bytes freed since the last trim pass
+    slabHeader *slabs[SLAB_CLASSES];  // slabs with free objects, by class
+    slabHeader *spareSlabs;       // empty slabs kept for any class
+    heapSegment *slabChunks;      // chunks of slabs, the newest first
+    char *slabNext;               // first slab not cut from the newest yet
+    buddyPool buddy;              // the arena under the buddy engine
+    int fixed;                    // never grows, set for a heap_t's arena
+    int shared;                   // lives in a MAP_SHARED file mapping,
+                                  // so never trimmed and parks nothing
+    int processShared;            // mapped by several processes at once,
+                                  // so locked even when not thread-safe
+} heapArena;
+
+/*
+ * The arenas of arenaCreate are bump allocators for objects that die
+ * together, called bump arenas here to keep them apart from the heap's
+ * own. Each one bumps a pointer through a list of chunks allocated from
+ * the heap. Reset rewinds it to the first chunk and keeps the chunks for
+ * reuse, so only arenaDestroy hands them back.
+ */
+#define BUMP_CHUNK_SIZE (64 * 1024)
+
+typedef struct bumpChunk {
+    struct bumpChunk *next;       // next chunk to bump through
+    size_t size;                  // bytes after the chunk header
+} bumpChunk;
+
+#define BUMP_HEADER     ALIGN_UP(sizeof(bumpChunk))
+
+/*
+ * A heap of heapCreate is a single mapping that starts with this handle,
+ * followed by one arena's worth of blocks. The arena is never registered
+ * anywhere and never grows, so nothing outside the mapping refers to it
+ * and heapDestroy only has to unmap it.
+ * A heap of heapOpen is the same layout mapped from a file, with the
+ * handle doubling as the file's superblock. The boundary tags only hold
+ * sizes and work at any address, but the arena's free lists hold
+ * pointers, so they are valid only where the heap was last mapped and
+ * rebuilt from the tags when it comes back somewhere else.
+ * A heap of heapShare lives in a POSIX shared memory object that several
+ * processes map at once. They cannot each rebuild the free lists, so
+ * they all map it at the address its creator got, and the lock is a
+ * robust process-shared mutex that stays in the mapping.
+ */
+#define HEAP_MAGIC      0x68656170UL      // "heap", fits 32-bit builds
+#define SHARE_TRIES     1000      // 1ms waits for a heap being created
+
+struct heapHandle {
+    heapArena arena;
+    size_t mapped;                // length of the mapping
+    size_t magic;                 // HEAP_MAGIC in a heap file
+    size_t handleSize;            // sizeof(heap_t) of the build that wrote it
+    char *base;                   // where the heap was last mapped
+    int clean;                    // closed by heapClose since last opened
+    size_t root;                  // offset of the root block, 0 for none
+    int fd;                       // the heap file, -1 for heapCreate's
+};
+
+/* Offset of the first block header in a heap_t's mapping.
+ */
+#define HANDLE_HEADER   \
+    (ALIGN_UP(sizeof(heap_t) + sizeof(blockHeader)) - sizeof(blockHeader))
+
+struct bumpArena {
+    bumpChunk *chunks;            // the first chunk, NULL before any
+    bumpChunk *current;           // chunk being bumped through
+    char *next;                   // next free byte in current
+    char *end;                    // end of current
+    size_t chunkSize;             // size new chunks are allocated with
+};
+
+/* Global variable - DO NOT CHANGE. It should always point to the first block,
+ * i.e., the block at the lowest address.
+ */
+blockHeader *heapStart = NULL;     
+
+/* Size of heap allocation padded to round to nearest page size.
+ * With several arenas this is the size of each arena.
+ */
+size_t allocsize;
+
+/*
+ * Additional global variables may be added as needed below
+ */
+
+/* The arenas and the region they are carved from. arenas[0] starts at
+ * heapStart.
+ */
+static heapArena arenas[MAX_ARENAS];
+static int numArenas = 1;
+static int arenaByCpu = 0;
+static char *regionStart;
+static size_t arenaSpan;
+
+/* Set when the arenas are run by the buddy engine instead of as chains of
+ * boundary-tagged blocks.
+ */
+static int buddyEngine = 0;
+
+/* Minimum size of a grown segment, 0 when the heap may not grow, and the
+ * chunk to segment table for grown segments.
+ */
+static size_t growSize = 0;
+static heapSegment **segmentMap[1 << MAP_ROOT_BITS];
+
+/* Trimming. Once an arena has freed trimThreshold bytes the interior pages
+ * of its large free blocks are handed back to the kernel with trimAdvice.
+ * A threshold of 0 leaves trimming to explicit heapTrim calls.
+ */
+static size_t pageSize;
+static size_t trimThreshold = 0;
+static int trimAdvice = MADV_DONTNEED;
+
+/* Huge pages. Unless hugePages is HEAP_HUGE_NONE, arenas and grown
+ * segments are mapped in whole huge pages of HUGE_SIZE bytes and backed
+ * by huge pages where the kernel has them. Trimming arenas then works in
+ * trimGranule units of a whole huge page, so that it never splits one.
+ */
+#define HUGE_SIZE       ((size_t)1 << 21)
+
+static int hugePages = HEAP_HUGE_NONE;
+static size_t trimGranule;
+
+/* Requests of at least mmapThreshold bytes get a mapping of their own,
+ * 0 keeps every request in the arenas. directCookie is a per-process
+ * secret that makes the check word in front of a mapped block's header
+ * hard to forge, and directMapped counts the bytes in such mappings.
+ */
+static size_t mmapThreshold = 0;
+static uintptr_t directCookie;
+static size_t directMapped = 0;
+
+/* Requests of up to slabLimit bytes come from slabs, 0 leaves every
+ * request to the blocks. slabMapped counts the bytes in chunks of slabs.
+ */
+static size_t slabLimit = 0;
+static size_t slabMapped = 0;
+
+/* Most bytes an arena parks on its quick lists, 0 coalesces every free
+ * right away.
+ */
+static size_t quickBudget = 0;
+
+/* Thread-safe mode state. threadArena is where the calling thread
+ * allocates when arenas are handed out round-robin, tcache is its block
+ * cache. Both use the initial-exec TLS model so that touching them never
+ * calls into the dynamic loader, which may itself call malloc.
+ */
+static int threadSafe = 0;
+static unsigned int nextArena = 0;
+static pthread_key_t tcacheKey;
+static __thread heapArena *threadArena
+        __attribute__((tls_model("initial-exec")));
+static __thread threadCache tcache
+        __attribute__((tls_model("initial-exec")));
+
+/* Per-CPU cache state. cpuCaches holds a cache for each of numCpus CPUs
+ * once HEAP_OPT_CPU_CACHE has taken effect, and is NULL otherwise.
+ */
+static int cpuCacheWanted = 0;
+static cpuCache *cpuCaches = NULL;
+static long numCpus;
+
+static inline size_t blockSize(blockHeader *block) {
+    return block->size_status & SIZE_MASK;
+}
+
+static inline blockHeader *nextBlock(blockHeader *block) {
+    return (blockHeader*)((char*)block + blockSize(block));
+}
+
+static inline freeLinks *linksOf(blockHeader *block) {
+    return (freeLinks*)(block + 1);
+}
+
+static inline treeNode *nodeOf(blockHeader *block) {
+    return (treeNode*)(block + 1);
+}
+
+/*
+ * The p-bit of the block after the one being changed may belong to a block
+ * that another thread owns and reads without a lock, so it is flipped
+ * with an atomic read-modify-write instead of a plain store.
+ */
+static inline void setPrevAllocated(blockHeader *block, int allocated) {
+    if (allocated) {
+        __atomic_fetch_or(&block->size_status, P_BIT, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_and(&block->size_status, ~P_BIT, __ATOMIC_RELAXED);
+    }
+}
+
+static inline void setFooter(blockHeader *block, size_t size) {
+    ((blockHeader*)((char*)block + size) - 1)->size_status = size;
+}
+
+/*
+ * Returns the block size needed to hold a payload of size bytes: the
+ * header is added, the sum is rounded up to a multiple of ALIGNMENT and it
+ * is never smaller than a free block needs for its links and footer.
+ */
+static inline size_t blockSizeFor(size_t size) {
+    size_t blockSz = ALIGN_UP(size + sizeof(blockHeader));
+    return blockSz < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : blockSz;
+}
+
+/*
+ * Maps a block size to the index of the free list holding blocks of that
+ * size.
+ */
+static int binIndex(size_t size) {
+    if (size < SMALL_LIMIT) {
+        return size >> ALIGN_SHIFT;
+    }
+    int lg = SIZE_BITS - 1 - __builtin_clzl(size);
+    return SMALL_BINS + (lg - SMALL_SHIFT) * SUB_BINS + 
+            ((size >> (lg - SUB_SHIFT)) & (SUB_BINS - 1));
+}
+
+/*
+ * Returns the index of the first non-empty bin at or after idx, or -1 if
+ * every such bin is empty.
+ */
+static int nextNonEmptyBin(heapArena *arena, int idx) {
+    int word = idx / 32;
+    if (word >= BINMAP_WORDS) {
+        return -1;
+    }
+    unsigned int bits = arena->binmap[word] & (~0u << (idx % 32));
+    if (bits == 0) {
+        //no luck in idx's own word, the summary points at the next one
+        unsigned int words = arena->binmapWords & (~0u << word << 1);
+        if (words == 0) {
+            return -1;
+        }
+        word = __builtin_ctz(words);
+        bits = arena->binmap[word];
+    }
+    return word * 32 + __builtin_ctz(bits);
+}
+
+/* Set while best-fit is the placement policy, so that arenas laid out from
+ * then on put large free blocks into the best-fit tree. An arena keeps
+ * what it was laid out with even if the policy changes later.
+ */
+static int useSizeTree = 0;
+
+static inline int inSizeTree(heapArena *arena, blockHeader *block) {
+    return arena->useSizeTree && blockSize(block) >= SMALL_LIMIT;
+}
+
+static inline int isRed(blockHeader *block) {
+    return block != NULL && nodeOf(block)->red;
+}
+
+/*
+ * Orders tree nodes by size and then by address.
+ */
+static inline int treeLess(blockHeader *a, blockHeader *b) {
+    return blockSize(a) < blockSize(b) || 
+            (blockSize(a) == blockSize(b) && a < b);
+}
+
+/*
+ * Puts child where block hangs from its parent, or at the root.
+ */
+static void replaceChild(heapArena *arena, blockHeader *block, 
+        blockHeader *child) {
+    blockHeader *parent = nodeOf(block)->parent;
+    if (parent == NULL) {
+        arena->sizeTree = child;
+    } else if (nodeOf(parent)->left == block) {
+        nodeOf(parent)->left = child;
+    } else {
+        nodeOf(parent)->right = child;
+    }
+    if (child != NULL) {
+        nodeOf(child)->parent = parent;
+    }
+}
+
+static void rotateLeft(heapArena *arena, blockHeader *block) {
+    treeNode *node = nodeOf(block);
+    blockHeader *pivot = node->right;
+    replaceChild(arena, block, pivot);
+    node->right = nodeOf(pivot)->left;
+    if (node->right != NULL) {
+        nodeOf(node->right)->parent = block;
+    }
+    nodeOf(pivot)->left = block;
+    node->parent = pivot;
+}
+
+static void rotateRight(heapArena *arena, blockHeader *block) {
+    treeNode *node = nodeOf(block);
+    blockHeader *pivot = node->left;
+    replaceChild(arena, block, pivot);
+    node->left = nodeOf(pivot)->right;
+    if (node->left != NULL) {
+        nodeOf(node->left)->parent = block;
+    }
+    nodeOf(pivot)->right = block;
+    node->parent = pivot;
+}
+
+static blockHeader *treeFirst(blockHeader *block) {
+    while (block != NULL && nodeOf(block)->left != NULL) {
+        block = nodeOf(block)->left;
+    }
+    return block;
+}
+
+/*
+ * Returns the node after block in size order, or NULL.
+ */
+static blockHeader *treeNext(blockHeader *block) {
+    if (nodeOf(block)->right != NULL) {
+        return treeFirst(nodeOf(block)->right);
+    }
+    blockHeader *parent = nodeOf(block)->parent;
+    while (parent != NULL && nodeOf(parent)->right == block) {
+        block = parent;
+        parent = nodeOf(block)->parent;
+    }
+    return parent;
+}
+
+static void treeInsert(heapArena *arena, blockHeader *block) {
+    blockHeader *parent = NULL;
+    blockHeader *cur = arena->sizeTree;
+    while (cur != NULL) {
+        parent = cur;
+        cur = treeLess(block, cur) ? nodeOf(cur)->left : nodeOf(cur)->right;
+    }
+    treeNode *node = nodeOf(block);
+    node->left = NULL;
+    node->right = NULL;
+    node->parent = parent;
+    node->red = 1;
+    if (parent == NULL) {
+        arena->sizeTree = block;
+    } else if (treeLess(block, parent)) {
+        nodeOf(parent)->left = block;
+    } else {
+        nodeOf(parent)->right = block;
+    }
+
+    //a red parent means two reds in a row, recolor or rotate upwards
+    while (isRed(parent = nodeOf(block)->parent)) {
+        blockHeader *grand = nodeOf(parent)->parent;
+        if (parent == nodeOf(grand)->left) {
+            blockHeader *uncle = nodeOf(grand)->right;
+            if (isRed(uncle)) {
+                nodeOf(parent)->red = 0;
+                nodeOf(uncle)->red = 0;
+                nodeOf(grand)->red = 1;
+                block = grand;
+                continue;
+            }
+            if (block == nodeOf(parent)->right) {
+                rotateLeft(arena, parent);
+                parent = block;
+            }
+            nodeOf(parent)->red = 0;
+            nodeOf(grand)->red = 1;
+            rotateRight(arena, grand);
+        } else {
+            blockHeader *uncle = nodeOf(grand)->left;
+            if (isRed(uncle)) {
+                nodeOf(parent)->red = 0;
+                nodeOf(uncle)->red = 0;
+                nodeOf(grand)->red = 1;
+                block = grand;
+                continue;
+            }
+            if (block == nodeOf(parent)->left) {
+                rotateRight(arena, parent);
+                parent = block;
+            }
+            nodeOf(parent)->red = 0;
+            nodeOf(grand)->red = 1;
+            rotateLeft(arena, grand);
+        }
+        break;
+    }
+    nodeOf(arena->sizeTree)->red = 0;
+}
+
+static void treeRemove(heapArena *arena, blockHeader *block) {
+    treeNode *node = nodeOf(block);
+    blockHeader *child;           // node moving into the removed spot
+    blockHeader *parent;          // its parent afterwards
+    int removedRed = node->red;
+
+    if (node->left == NULL || node->right == NULL) {
+        child = node->left != NULL ? node->left : node->right;
+        parent = node->parent;
+        replaceChild(arena, block, child);
+    } else {
+        //swap in the successor, which has no left child
+        blockHeader *next = treeFirst(node->right);
+        treeNode *nextNode = nodeOf(next);
+        removedRed = nextNode->red;
+        child = nextNode->right;
+        if (nextNode->parent == block) {
+            parent = next;
+        } else {
+            parent = nextNode->parent;
+            replaceChild(arena, next, child);
+            nextNode->right = node->right;
+            nodeOf(nextNode->right)->parent = next;
+        }
+        replaceChild(arena, block, next);
+        nextNode->left = node->left;
+        nodeOf(nextNode->left)->parent = next;
+        nextNode->red = node->red;
+    }
+    if (removedRed) {
+        return;
+    }
+
+    //a black node went missing on child's path, borrow one from a sibling
+    //or push the shortage upwards
+    while (child != arena->sizeTree && !isRed(child)) {
+        if (child == nodeOf(parent)->left) {
+            blockHeader *sibling = nodeOf(parent)->right;
+            if (isRed(sibling)) {
+                nodeOf(sibling)->red = 0;
+                nodeOf(parent)->red = 1;
+                rotateLeft(arena, parent);
+                sibling = nodeOf(parent)->right;
+            }
+            if (!isRed(nodeOf(sibling)->left) && 
+                    !isRed(nodeOf(sibling)->right)) {
+                nodeOf(sibling)->red = 1;
+                child = parent;
+                parent = nodeOf(child)->parent;
+                continue;
+            }
+            if (!isRed(nodeOf(sibling)->right)) {
+                nodeOf(nodeOf(sibling)->left)->red = 0;
+                nodeOf(sibling)->red = 1;
+                rotateRight(arena, sibling);
+                sibling = nodeOf(parent)->right;
+            }
+            nodeOf(sibling)->red = nodeOf(parent)->red;
+            nodeOf(parent)->red = 0;
+            nodeOf(nodeOf(sibling)->right)->red = 0;
+            rotateLeft(arena, parent);
+        } else {
+            blockHeader *sibling = nodeOf(parent)->left;
+            if (isRed(sibling)) {
+                nodeOf(sibling)->red = 0;
+                nodeOf(parent)->red = 1;
+                rotateRight(arena, parent);
+                sibling = nodeOf(parent)->left;
+            }
+            if (!isRed(nodeOf(sibling)->left) && 
+                    !isRed(nodeOf(sibling)->right)) {
+                nodeOf(sibling)->red = 1;
+                child = parent;
+                parent = nodeOf(child)->parent;
+                continue;
+            }
+            if (!isRed(nodeOf(sibling)->left)) {
+                nodeOf(nodeOf(sibling)->right)->red = 0;
+                nodeOf(sibling)->red = 1;
+                rotateLeft(arena, sibling);
+                sibling = nodeOf(parent)->left;
+            }
+            nodeOf(sibling)->red = nodeOf(parent)->red;
+            nodeOf(parent)->red = 0;
+            nodeOf(nodeOf(sibling)->left)->red = 0;
+            rotateRight(arena, parent);
+        }
+        child = arena->sizeTree;
+    }
+    if (child != NULL) {
+        nodeOf(child)->red = 0;
+    }
+}
+
+/*
+ * Returns the smallest, and among those the lowest addressed, block in the
+ * best-fit tree of at least size bytes, or NULL.
+ */
+static blockHeader *treeFit(heapArena *arena, size_t size) {
+    blockHeader *fit = NULL;
+    blockHeader *cur = arena->sizeTree;
+    while (cur != NULL) {
+        if (blockSize(cur) >= size) {
+            fit = cur;
+            cur = nodeOf(cur)->left;
+        } else {
+            cur = nodeOf(cur)->right;
+        }
+    }
+    return fit;
+}
+
+/*
+ * Pushes a free block onto the front of the list for its size class, or
+ * puts it in the best-fit tree.
+ * The block's header must already hold its final size.
+ */
+static void insertFree(heapArena *arena, blockHeader *block) {
+    if (inSizeTree(arena, block)) {
+        treeInsert(arena, block);
+        return;
+    }
+    int idx = binIndex(blockSize(block));
+    freeLinks *links = linksOf(block);
+    links->prev = NULL;
+    links->next = arena->bins[idx];
+    if (arena->bins[idx] != NULL) {
+        linksOf(arena->bins[idx])->prev = block;
+    }
+    arena->bins[idx] = block;
+    arena->binmap[idx / 32] |= 1u << (idx % 32);
+    arena->binmapWords |= 1u << (idx / 32);
+}
+
+/*
+ * Unlinks a free block from its list, clearing the bin's bit when the list
+ * becomes empty, or takes it out of the best-fit tree.
+ */
+static void removeFree(heapArena *arena, blockHeader *block) {
+    if (inSizeTree(arena, block)) {
+        treeRemove(arena, block);
+        return;
+    }
+    freeLinks *links = linksOf(block);
+    if (links->prev != NULL) {
+        linksOf(links->prev)->next = links->next;
+    } else {
+        int idx = binIndex(blockSize(block));
+        arena->bins[idx] = links->next;
+        if (links->next == NULL) {
+            arena->binmap[idx / 32] &= ~(1u << (idx % 32));
+            if (arena->binmap[idx / 32] == 0) {
+                arena->binmapWords &= ~(1u << (idx / 32));
+            }
+        }
+    }
+    if (links->next != NULL) {
+        linksOf(links->next)->prev = links->prev;
+    }
+    if (arena->rover == block) {
+        arena->rover = links->next;
+    }
+}
+
+/*
+ * The wilderness is the free block at the end of the arena's newest
+ * segment, or of whichever segment last had its tail freed. It is kept
+ * off the free lists and without a footer, so that allocBlock can serve
+ * requests from its front by just moving its header up, and frees that
+ * reach it roll it back down.
+ */
+
+/*
+ * Takes a free block off its list, or takes over the wilderness.
+ */
+static inline void detachFree(heapArena *arena, blockHeader *block) {
+    if (block == arena->wilderness) {
+        arena->wilderness = NULL;
+    } else {
+        removeFree(arena, block);
+    }
+}
+
+/*
+ * Makes a block whose header already holds its final size free. It
+ * becomes the wilderness when it ends a segment and the arena has none,
+ * and goes on its list otherwise.
+ */
+static inline void attachFree(heapArena *arena, blockHeader *block) {
+    if (arena->wilderness == NULL && blockSize(nextBlock(block)) == 0) {
+        arena->wilderness = block;
+        return;
+    }
+    setFooter(block, blockSize(block));
+    insertFree(arena, block);
+}
+
+/*
+ * Cuts a block of blockSz bytes off the front of the wilderness, or hands
+ * out all of it when the rest could not stand alone.
+ * Returns the header of the allocated block or NULL if the wilderness is
+ * too small.
+ */
+static inline blockHeader *bumpWilderness(heapArena *arena, size_t blockSz) {
+    blockHeader *block = arena->wilderness;
+    if (block == NULL || blockSize(block) < blockSz) {
+        return NULL;
+    }
+    //a free block always follows an allocated one
+    size_t remainder = blockSize(block) - blockSz;
+    if (remainder >= MIN_BLOCK_SIZE) {
+        block->size_status = blockSz + P_BIT + A_BIT;
+        arena->wilderness = nextBlock(block);
+        arena->wilderness->size_status = remainder + P_BIT;
+    } else {
+        block->size_status |= A_BIT;
+        setPrevAllocated(nextBlock(block), 1);
+        arena->wilderness = NULL;
+    }
+    return block;
+}
+
+/*
+ * Placement policies. Each finds a free block of at least size bytes in
+ * an arena, or returns NULL, and leaves the block on its list; allocBlock
+ * does the rest. Bins cover increasing size ranges, so only the request's
+ * own bin can hold blocks that are too small and any block past it fits.
+ */
+
+/*
+ * First-fit: the first block that fits, searching the request's own bin
+ * and then the head of the next non-empty one.
+ */
+static blockHeader *firstFit(heapArena *arena, size_t size) {
+    int idx = binIndex(size);
+    blockHeader *block;
+    for (block = arena->bins[idx]; block; block = linksOf(block)->next) {
+        if (blockSize(block) >= size) {
+            return block;
+        }
+    }
+    idx = nextNonEmptyBin(arena, idx + 1);
+    return idx < 0 ? NULL : arena->bins[idx];
+}
+
+/*
+ * Next-fit: carries on down the list the previous search ended in, as long
+ * as that list can hold the request, and falls back to first-fit.
+ */
+static blockHeader *nextFit(heapArena *arena, size_t size) {
+    blockHeader *block = arena->rover;
+    if (block != NULL && binIndex(blockSize(block)) >= binIndex(size)) {
+        for (; block; block = linksOf(block)->next) {
+            if (blockSize(block) >= size) {
+                arena->rover = linksOf(block)->next;
+                return block;
+            }
+        }
+    }
+    block = firstFit(arena, size);
+    arena->rover = block == NULL ? NULL : linksOf(block)->next;
+    return block;
+}
+
+/*
+ * Best-fit: the smallest block that fits, the lowest addressed one among
+ * blocks of that size. Only the first bin holding a fit is searched, and
+ * past the small bins the tree finds it in logarithmic time.
+ */
+static blockHeader *bestFit(heapArena *arena, size_t size) {
+    blockHeader *best = NULL;
+    int idx = nextNonEmptyBin(arena, binIndex(size));
+    for (; idx >= 0 && best == NULL; idx = nextNonEmptyBin(arena, idx + 1)) {
+        blockHeader *block;
+        for (block = arena->bins[idx]; block; block = linksOf(block)->next) {
+            size_t blockSz = blockSize(block);
+            if (blockSz >= size && (best == NULL || blockSz < blockSize(best) ||
+                    (blockSz == blockSize(best) && block < best))) {
+                best = block;
+            }
+        }
+    }
+    if (best == NULL && arena->useSizeTree) {
+        best = treeFit(arena, size);
+    }
+    return best;
+}
+
+/*
+ * Good-fit: best-fit over at most GOOD_FIT_PROBES fitting blocks, stopping
+ * early at one that wastes no more than a 1/GOOD_FIT_SLACK of the request.
+ */
+#define GOOD_FIT_PROBES 8
+#define GOOD_FIT_SLACK  8
+
+static blockHeader *goodFit(heapArena *arena, size_t size) {
+    blockHeader *best = NULL;
+    int probes = 0;
+    int idx = nextNonEmptyBin(arena, binIndex(size));
+    for (; idx >= 0 && best == NULL; idx = nextNonEmptyBin(arena, idx + 1)) {
+        blockHeader *block;
+        for (block = arena->bins[idx]; block; block = linksOf(block)->next) {
+            if (blockSize(block) < size) {
+                continue;
+            }
+            if (best == NULL || blockSize(block) < blockSize(best)) {
+                best = block;
+            }
+            if (blockSize(best) - size <= size / GOOD_FIT_SLACK || 
+                    ++probes == GOOD_FIT_PROBES) {
+                return best;
+            }
+        }
+    }
+    return best;
+}
+
+/*
+ * TLSF: rounds the request up to the lower bound of the next size class,
+ * so that the head of the first non-empty bin from there on always fits.
+ * No list is walked and the bitmap search is two find-first-sets, which
+ * makes the lookup constant time whatever the heap holds. Only when no
+ * such bin exists is the head of the request's own bin tried as well.
+ */
+static blockHeader *tlsfFit(heapArena *arena, size_t size) {
+    size_t rounded = size;
+    if (size >= SMALL_LIMIT) {
+        int lg = SIZE_BITS - 1 - __builtin_clzl(size);
+        size_t step = (size_t)1 << (lg - SUB_SHIFT);
+        rounded = (size + step - 1) & ~(step - 1);
+    }
+    int idx = nextNonEmptyBin(arena, binIndex(rounded));
+    if (idx >= 0) {
+        return arena->bins[idx];
+    }
+    blockHeader *head = arena->bins[binIndex(size)];
+    return head != NULL && blockSize(head) >= size ? head : NULL;
+}
+
+/* The policies by HEAP_POLICY_ number and the one allocBlock uses.
+ */
+static blockHeader *(*const fitPolicies[])(heapArena *arena, size_t size) = {
+    firstFit, nextFit, bestFit, goodFit, tlsfFit
+};
+static blockHeader *(*findFit)(heapArena *arena, size_t size) = firstFit;
+ 
+/*
+ * Maps len bytes of fresh memory whose byte at offset is aligned to align,
+ * a power of two greater than offset.
+ * Returns NULL if the mapping fails.
+ */
+static char *mapAligned(size_t len, size_t align, size_t offset) {
+    char *raw = mmap(NULL, len + align, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == raw) {
+        return NULL;
+    }
+    //give back the slack on both sides of the aligned range
+    char *base = (char*)(((uintptr_t)raw + offset + align - 1) & 
+            ~(uintptr_t)(align - 1)) - offset;
+    if (base > raw) {
+        munmap(raw, base - raw);
+    }
+    if (raw + align > base) {
+        munmap(base + len, raw + align - base);
+    }
+    return base;
+}
+
+/*
+ * Maps len bytes, a multiple of HUGE_SIZE, aligned to HUGE_SIZE for the
+ * heap under hugePages. HEAP_HUGE_TLB tries the kernel's reserved huge
+ * pages first, everything else asks for transparent huge pages, and the
+ * memory is left with normal pages if neither is available.
+ * Returns NULL if the mapping fails.
+ */
+static char *mapHuge(size_t len) {
+#ifdef MAP_HUGETLB
+    if (hugePages == HEAP_HUGE_TLB) {
+        char *base = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (MAP_FAILED != base) {
+            return base;
+        }
+    }
+#endif
+    char *base = mapAligned(len, HUGE_SIZE, 0);
+#ifdef MADV_HUGEPAGE
+    if (base != NULL) {
+        madvise(base, len, MADV_HUGEPAGE);
+    }
+#endif
+    return base;
+}
+
+/*
+ * Returns the grown segment whose mapping holds ptr, or NULL.
+ */
+static heapSegment *lookupSegment(void *ptr) {
+    uintptr_t chunk = (uintptr_t)ptr >> CHUNK_SHIFT;
+    if (chunk >> (MAP_ROOT_BITS + MAP_LEAF_BITS) != 0) {
+        return NULL;
+    }
+    heapSegment **leaf = __atomic_load_n(&segmentMap[chunk >> MAP_LEAF_BITS],
+            __ATOMIC_ACQUIRE);
+    if (leaf == NULL) {
+        return NULL;
+    }
+    return __atomic_load_n(&leaf[chunk & ((1 << MAP_LEAF_BITS) - 1)],
+            __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Points every chunk of the len byte mapping at base to segment.
+ * Returns 0 on success.
+ * Returns -1 if a leaf of segmentMap cannot be mapped.
+ */
+static int registerSegment(heapSegment *segment, char *base, size_t len) {
+    uintptr_t chunk = (uintptr_t)base >> CHUNK_SHIFT;
+    uintptr_t last = ((uintptr_t)base + len - 1) >> CHUNK_SHIFT;
+    for (; chunk <= last; chunk++) {
+        heapSegment ***root = &segmentMap[chunk >> MAP_LEAF_BITS];
+        heapSegment **leaf = __atomic_load_n(root, __ATOMIC_ACQUIRE);
+        if (leaf == NULL) {
+            size_t leafSize = sizeof(heapSegment*) << MAP_LEAF_BITS;
+            heapSegment **fresh = mmap(NULL, leafSize, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (MAP_FAILED == fresh) {
+                return -1;
+            }
+            //another arena may be filling in the same leaf
+            if (__atomic_compare_exchange_n(root, &leaf, fresh, 0,
+                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                leaf = fresh;
+            } else {
+                munmap(fresh, leafSize);
+            }
+        }
+        __atomic_store_n(&leaf[chunk & ((1 << MAP_LEAF_BITS) - 1)], segment,
+                __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+/*
+ * Turns size bytes at start into one big free block followed by an end
+ * mark and hands them to the arena as its newest segment.
+ */
+static void initSegment(heapArena *arena, heapSegment *segment,
+        blockHeader *start, size_t size) {
+    blockHeader* endMark;
+
+    segment->arena = arena;
+    segment->next = NULL;
+    segment->start = start;
+    segment->size = size;
+
+    // Set the end mark
+    endMark = (blockHeader*)((char*)start + size);
+    endMark->size_status = 1;
+
+    // Set size in header
+    start->size_status = size;
+
+    // Set p-bit as allocated in header
+    // note a-bit left at 0 for free
+    start->size_status += 2;
+
+    // Set the footer
+    setFooter(start, size);
+
+    // Append it to the arena's segments and make it the wilderness, the
+    // old one is too small for what allocHeap needs and goes on its list
+    if (segment != &arena->first) {
+        heapSegment *last = &arena->first;
+        while (last->next != NULL) {
+            last = last->next;
+        }
+        last->next = segment;
+    }
+    if (arena->wilderness != NULL) {
+        setFooter(arena->wilderness, blockSize(arena->wilderness));
+        insertFree(arena, arena->wilderness);
+    }
+    arena->wilderness = start;
+}
+
+/*
+ * Maps a new segment big enough for a block of blockSz bytes, and at
+ * least growSize bytes, and adds it to the arena.
+ * Returns 0 on success.
+ * Returns -1 if the heap may not grow or the mapping fails.
+ */
+static int growArena(heapArena *arena, size_t blockSz) {
+    if (growSize == 0 || arena->fixed) {
+        return -1;
+    }
+    size_t len = blockSz + SEGMENT_HEADER + sizeof(blockHeader);
+    if (len < growSize) {
+        len = growSize;
+    }
+    //huge pages are whole chunks
+    size_t unit = hugePages != HEAP_HUGE_NONE ? HUGE_SIZE : CHUNK_SIZE;
+    len = (len + unit - 1) & ~(size_t)(unit - 1);
+
+    char *base = hugePages != HEAP_HUGE_NONE ? mapHuge(len) : 
+            mapAligned(len, CHUNK_SIZE, 0);
+    if (base == NULL) {
+        return -1;
+    }
+    heapSegment *segment = (heapSegment*)base;
+    if (registerSegment(segment, base, len) != 0) {
+        munmap(base, len);
+        return -1;
+    }
+    initSegment(arena, segment, (blockHeader*)(base + SEGMENT_HEADER),
+            len - SEGMENT_HEADER - sizeof(blockHeader));
+    return 0;
+}
+
+/*
+ * Returns the check word kept in front of the header of a block with a
+ * mapping of its own.
+ */
+static inline size_t directCheck(blockHeader *header) {
+    return (uintptr_t)header ^ directCookie ^ header->size_status;
+}
+
+/*
+ * Returns the offset of a mapped block's payload into its mapping. This
+ * is the payload's offset into its page, or a whole page for a payload
+ * that starts a page and has its header at the end of the page before.
+ */
+static inline size_t directOffset(void *ptr) {
+    size_t offset = (uintptr_t)ptr & (pageSize - 1);
+    return offset != 0 ? offset : pageSize;
+}
+
+/*
+ * Gives a request a mapping of its own so large blocks neither fragment
+ * the arenas nor need coalescing when freed. The payload starts at the
+ * first multiple of align, a power of two, that is at least ALIGNMENT
+ * bytes into the mapping, and no more than a page in. The header sits
+ * right in front of it after the check word, and its size is the length
+ * of the whole mapping.
+ * Returns the payload or NULL if the mapping fails.
+ */
+static void *allocDirect(size_t size, size_t align) {
+    size_t offset = align < ALIGNMENT ? ALIGNMENT : 
+            align < pageSize ? align : pageSize;
+    size_t len = size + offset;
+    len = (len + pageSize - 1) & ~(pageSize - 1);
+    char *base;
+    if (align <= pageSize) {
+        base = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (MAP_FAILED == base) {
+            return NULL;
+        }
+    } else {
+        base = mapAligned(len, align, offset);
+        if (base == NULL) {
+            return NULL;
+        }
+    }
+    blockHeader *header = (blockHeader*)(base + offset) - 1;
+    header->size_status = len + M_BIT + A_BIT;
+    (header - 1)->size_status = directCheck(header);
+    __atomic_fetch_add(&directMapped, len, __ATOMIC_RELAXED);
+    return header + 1;
+}
+
+/*
+ * Returns the header of the block allocDirect returned as ptr. ptr lies
+ * outside every arena, so it is only trusted once its offset into the
+ * page, its header bits and its check word all match. The page holding
+ * the header and check word is only read once mincore says it is mapped,
+ * since a block freed before has been unmapped.
+ * Returns NULL if ptr is not such a block.
+ */
+static blockHeader *directHeader(void *ptr) {
+    size_t offset = directOffset(ptr);
+    if (offset < ALIGNMENT || (offset & (offset - 1)) != 0) {
+        return NULL;
+    }
+    //the check word and header share a page, the one ALIGNMENT bytes in
+    //front of ptr lies in
+    unsigned char resident;
+    uintptr_t page = ((uintptr_t)ptr - ALIGNMENT) & ~(uintptr_t)(pageSize - 1);
+    if (mincore((void*)page, pageSize, &resident) != 0) {
+        return NULL;
+    }
+    blockHeader *header = (blockHeader*)ptr - 1;
+    if ((header->size_status & (M_BIT | A_BIT)) != (M_BIT | A_BIT) ||
+            (header - 1)->size_status != directCheck(header)) {
+        return NULL;
+    }
+    return header;
+}
+
+/*
+ * Unmaps a block allocated by allocDirect.
+ * Returns 0 on success.
+ * Returns -1 if ptr is not such a block.
+ */
+static int freeDirect(void *ptr) {
+    blockHeader *header = directHeader(ptr);
+    if (header == NULL) {
+        return -1;
+    }
+    size_t len = blockSize(header);
+    __atomic_fetch_sub(&directMapped, len, __ATOMIC_RELAXED);
+    return munmap((char*)ptr - directOffset(ptr), len) == 0 ? 0 : -1;
+}
+
+/*
+ * Resizes a block allocated by allocDirect with mremap, which moves the
+ * pages rather than copying them if the mapping cannot grow in place.
+ * The payload keeps its offset into the mapping, but a moved one may lose
+ * an alignment past a page.
+ * Returns the new payload or NULL if the mapping cannot be resized.
+ */
+static void *reallocDirect(blockHeader *header, size_t size) {
+    size_t offset = directOffset(header + 1);
+    size_t len = size + offset;
+    len = (len + pageSize - 1) & ~(pageSize - 1);
+    size_t oldLen = blockSize(header);
+    if (len == oldLen) {
+        return header + 1;
+    }
+    char *base = mremap((char*)(header + 1) - offset, oldLen, len,
+            MREMAP_MAYMOVE);
+    if (MAP_FAILED == base) {
+        return NULL;
+    }
+    header = (blockHeader*)(base + offset) - 1;
+    header->size_status = len + M_BIT + A_BIT;
+    (header - 1)->size_status = directCheck(header);
+    __atomic_fetch_add(&directMapped, len - oldLen, __ATOMIC_RELAXED);
+    return header + 1;
+}
+
+static inline size_t buddySize(int order) {
+    return BUDDY_MIN << order;
+}
+
+static inline int testBit(unsigned long *map, size_t bit) {
+    return (map[bit / LONG_BITS] >> (bit % LONG_BITS)) & 1;
+}
+
+static inline void setBit(unsigned long *map, size_t bit) {
+    map[bit / LONG_BITS] |= 1UL << (bit % LONG_BITS);
+}
+
+static inline void clearBit(unsigned long *map, size_t bit) {
+    map[bit / LONG_BITS] &= ~(1UL << (bit % LONG_BITS));
+}
+
+/*
+ * Returns the number of the block of the given order at offset, which is
+ * its bit in that order's bitmaps.
+ */
+static inline size_t buddyBit(size_t offset, int order) {
+    return offset >> (BUDDY_SHIFT + order);
+}
+
+/*
+ * Returns the smallest order whose blocks hold size bytes.
+ */
+static inline int buddyOrderFor(size_t size) {
+    if (size <= BUDDY_MIN) {
+        return 0;
+    }
+    return SIZE_BITS - __builtin_clzl(size - 1) - BUDDY_SHIFT;
+}
+
+/*
+ * Returns the bytes taken by the bitmaps of a pool of size bytes.
+ */
+static size_t buddyMapBytes(size_t size) {
+    size_t words = 0;
+    int order;
+    for (order = 0; order < BUDDY_ORDERS && buddySize(order) <= size; 
+            order++) {
+        words += 2 * ((buddyBit(size, order) + LONG_BITS - 1) / LONG_BITS);
+    }
+    return words * sizeof(unsigned long);
+}
+
+static void buddyPush(buddyPool *pool, char *block, int order) {
+    buddyLinks *links = (buddyLinks*)block;
+    links->prev = NULL;
+    links->next = pool->lists[order];
+    if (links->next != NULL) {
+        links->next->prev = links;
+    }
+    pool->lists[order] = links;
+    pool->nonEmpty |= (size_t)1 << order;
+    setBit(pool->freeBits[order], buddyBit(block - pool->base, order));
+}
+
+static void buddyUnlink(buddyPool *pool, char *block, int order) {
+    buddyLinks *links = (buddyLinks*)block;
+    if (links->prev != NULL) {
+        links->prev->next = links->next;
+    } else {
+        pool->lists[order] = links->next;
+        if (links->next == NULL) {
+            pool->nonEmpty &= ~((size_t)1 << order);
+        }
+    }
+    if (links->next != NULL) {
+        links->next->prev = links->prev;
+    }
+    clearBit(pool->freeBits[order], buddyBit(block - pool->base, order));
+}
+
+/*
+ * Lays out a buddy pool over the space bytes at base. The bitmaps go at
+ * the end so that the pool starts where the arena does and page sized
+ * blocks stay page aligned. The pool is then covered with the largest
+ * blocks that fit, which is one block per bit set in its size.
+ */
+static void initBuddyPool(buddyPool *pool, char *base, size_t space) {
+    size_t size = space & ~(BUDDY_MIN - 1);
+    size_t offset;
+    int order;
+
+    while (size + buddyMapBytes(size) > space) {
+        size = (space - buddyMapBytes(size)) & ~(BUDDY_MIN - 1);
+    }
+    pool->base = base;
+    pool->size = size;
+
+    unsigned long *map = (unsigned long*)(base + size);
+    for (order = 0; order < BUDDY_ORDERS && buddySize(order) <= size; 
+            order++) {
+        size_t words = (buddyBit(size, order) + LONG_BITS - 1) / LONG_BITS;
+        pool->freeBits[order] = map;
+        pool->splitBits[order] = map + words;
+        map += 2 * words;
+        memset(pool->freeBits[order], 0, 2 * words * sizeof(unsigned long));
+    }
+
+    for (offset = 0; offset + BUDDY_MIN <= size; offset += buddySize(order)) {
+        order = 0;
+        while (order + 1 < BUDDY_ORDERS && 
+                offset % buddySize(order + 1) == 0 && 
+                offset + buddySize(order + 1) <= size) {
+            order++;
+        }
+        buddyPush(pool, base + offset, order);
+    }
+}
+
+/*
+ * Returns the order of the block starting at offset, or -1 if no block
+ * starts there. Starting from the smallest order, a block at offset is
+ * only part of a bigger one as long as that bigger one is not split.
+ */
+static int buddyOrderAt(buddyPool *pool, size_t offset) {
+    int order = 0;
+    if (offset % BUDDY_MIN != 0 || offset >= pool->size) {
+        return -1;
+    }
+    for (;;) {
+        size_t up = buddySize(order + 1);
+        if (order + 1 >= BUDDY_ORDERS || offset + up > pool->size ||
+                offset % up != 0) {
+            break;
+        }
+        if (testBit(pool->splitBits[order + 1], buddyBit(offset, order + 1))) {
+            return order;
+        }
+        order++;
+    }
+    //a block aligned to twice its size and without room to double is one
+    //of the blocks the pool started out with, otherwise it is the upper
+    //half of a split block
+    size_t parent = offset & ~buddySize(order);
+    if (parent == offset) {
+        return order;
+    }
+    if (parent + buddySize(order + 1) > pool->size || 
+            !testBit(pool->splitBits[order + 1], buddyBit(parent, order + 1))) {
+        return -1;
+    }
+    return order;
+}
+
+/*
+ * Takes a block of at least size bytes from the smallest non-empty order
+ * that holds it, splitting it in halves down to the order needed.
+ * Callers in thread-safe mode must hold the arena's lock.
+ * Returns the block or NULL if the pool has none big enough.
+ */
+static void *buddyAlloc(buddyPool *pool, size_t size) {
+    int order = buddyOrderFor(size);
+    if (order >= BUDDY_ORDERS) {
+        return NULL;
+    }
+    size_t orders = pool->nonEmpty & (~(size_t)0 << order);
+    if (orders == 0) {
+        return NULL;
+    }
+    int found = __builtin_ctzl(orders);
+    char *block = (char*)pool->lists[found];
+    buddyUnlink(pool, block, found);
+    while (found > order) {
+        setBit(pool->splitBits[found], buddyBit(block - pool->base, found));
+        found--;
+        buddyPush(pool, block + buddySize(found), found);
+    }
+    return block;
+}
+
+/*
+ * Takes a block of at least size bytes whose address is a multiple of
+ * align, a power of two. Blocks are only aligned to their size relative
+ * to the start of the pool, so this looks through the free blocks from
+ * the smallest order that holds size up for one that has such an address
+ * a multiple of the block size into the pool, and splits the free block
+ * down to it.
+ * Callers in thread-safe mode must hold the arena's lock.
+ * Returns the block or NULL if the pool has none that fits.
+ */
+static void *buddyAllocAligned(buddyPool *pool, size_t size, size_t align) {
+    int order = buddyOrderFor(size);
+    if (order >= BUDDY_ORDERS) {
+        return NULL;
+    }
+    size_t need = buddySize(order);
+    int found;
+    for (found = order; found < BUDDY_ORDERS; found++) {
+        buddyLinks *links;
+        for (links = pool->lists[found]; links; links = links->next) {
+            char *block = (char*)links;
+            char *target = (char*)(((uintptr_t)block + align - 1) & 
+                    ~(uintptr_t)(align - 1));
+            if (((target - pool->base) & (need - 1)) != 0 ||
+                    target + need > block + buddySize(found)) {
+                continue;
+            }
+            //keep the half holding target at each split
+            buddyUnlink(pool, block, found);
+            while (found > order) {
+                setBit(pool->splitBits[found], 
+                        buddyBit(block - pool->base, found));
+                found--;
+                char *half = block + buddySize(found);
+                if (target >= half) {
+                    buddyPush(pool, block, found);
+                    block = half;
+                } else {
+                    buddyPush(pool, half, found);
+                }
+            }
+            return block;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Frees a block, merging it with its buddy for as long as the buddy is
+ * free as a whole.
+ * Callers in thread-safe mode must hold the arena's lock.
+ * Returns the size of the block freed.
+ * Returns 0 if ptr is not an allocated block of the pool.
+ */
+static size_t buddyFree(buddyPool *pool, void *ptr) {
+    size_t offset = (char*)ptr - pool->base;
+    int order = buddyOrderAt(pool, offset);
+    if (order < 0 || testBit(pool->freeBits[order], buddyBit(offset, order))) {
+        return 0;
+    }
+    size_t freed = buddySize(order);
+    while (order + 1 < BUDDY_ORDERS) {
+        size_t buddy = offset ^ buddySize(order);
+        size_t parent = offset & ~buddySize(order);
+        if (parent + buddySize(order + 1) > pool->size ||
+                !testBit(pool->freeBits[order], buddyBit(buddy, order))) {
+            break;
+        }
+        buddyUnlink(pool, pool->base + buddy, order);
+        clearBit(pool->splitBits[order + 1], buddyBit(parent, order + 1));
+        offset = parent;
+        order++;
+    }
+    buddyPush(pool, pool->base + offset, order);
+    return freed;
+}
+
+/*
+ * Returns the whole units of granule bytes, a power of two multiple of the
+ * page size, between first and last to the kernel.
+ * Returns the number of bytes released.
+ */
+static size_t trimRange(uintptr_t first, uintptr_t last, size_t granule) {
+    first = (first + granule - 1) & ~(uintptr_t)(granule - 1);
+    last &= ~(uintptr_t)(granule - 1);
+    if (last <= first) {
+        return 0;
+    }
+    if (madvise((void*)first, last - first, trimAdvice) != 0) {
+        //MADV_FREE is not supported by every kernel, fall back for good
+        if (errno != EINVAL || trimAdvice == MADV_DONTNEED) {
+            return 0;
+        }
+        trimAdvice = MADV_DONTNEED;
+        if (madvise((void*)first, last - first, trimAdvice) != 0) {
+            return 0;
+        }
+    }
+    return last - first;
+}
+
+/*
+ * Returns the whole pages inside a free block to the kernel, or the whole
+ * huge pages under hugePages. Only the header, the free list links or
+ * tree node and the footer have to stay in memory.
+ * Returns the number of bytes released.
+ */
+static size_t trimBlock(blockHeader *block) {
+    return trimRange((uintptr_t)(nodeOf(block) + 1), 
+            (uintptr_t)nextBlock(block) - sizeof(blockHeader), trimGranule);
+}
+
+/*
+ * Trims every free block of an arena that is big enough to hold a whole
+ * trimGranule, and its spare slabs past their headers.
+ * Callers in thread-safe mode must hold the arena's lock.
+ * Returns the number of bytes released.
+ */
+static size_t trimArena(heapArena *arena) {
+    size_t released = 0;
+    slabHeader *slab;
+    //dropping pages of a file mapping gives nothing back
+    if (arena->shared) {
+        arena->freedSinceTrim = 0;
+        return 0;
+    }
+    for (slab = arena->spareSlabs; slab; slab = slab->next) {
+        released += trimRange((uintptr_t)(slab + 1), 
+                ((uintptr_t)slab & ~(SLAB_SIZE - 1)) + SLAB_SIZE, pageSize);
+    }
+    int idx = nextNonEmptyBin(arena, binIndex(trimGranule));
+    for (; idx >= 0; idx = nextNonEmptyBin(arena, idx + 1)) {
+        blockHeader *block;
+        for (block = arena->bins[idx]; block; block = linksOf(block)->next) {
+            released += trimBlock(block);
+        }
+    }
+    blockHeader *block;
+    for (block = treeFirst(arena->sizeTree); block; block = treeNext(block)) {
+        released += trimBlock(block);
+    }
+    if (arena->wilderness != NULL) {
+        released += trimRange((uintptr_t)(arena->wilderness + 1),
+                (uintptr_t)nextBlock(arena->wilderness), trimGranule);
+    }
+    int order;
+    for (order = 0; order < BUDDY_ORDERS; order++) {
+        buddyLinks *links;
+        for (links = arena->buddy.lists[order]; links; links = links->next) {
+            released += trimRange((uintptr_t)(links + 1), 
+                    (uintptr_t)links + buddySize(order), trimGranule);
+        }
+    }
+    arena->freedSinceTrim = 0;
+    return released;
+}
+
+/*
+ * Frees an allocated block, coalescing it with free neighbors and putting
+ * the result on its free list. Runs a trim pass over the arena once it has
+ * freed trimThreshold bytes.
+ * Callers in thread-safe mode must hold the arena's lock.
+ */
+static void releaseBlock(heapArena *arena, blockHeader *freeBlockHeader) {
+    size_t freedSize = blockSize(freeBlockHeader);
+    size_t size = freedSize;
+    size_t prevBit = freeBlockHeader->size_status & P_BIT;
+
+    //if the next block is free take it off its list and absorb it, the end
+    //mark always looks allocated so it is never absorbed
+    blockHeader *nextBlockHeader = nextBlock(freeBlockHeader);
+    if ((nextBlockHeader->size_status & A_BIT) == 0) {
+        detachFree(arena, nextBlockHeader);
+        size += blockSize(nextBlockHeader);
+    }
+
+    //if the previous block is free its footer gives us its start, and the
+    //freed header, left inside the merged block, must stop looking
+    //allocated or a second free of it would go through
+    if (prevBit == 0) {
+        freeBlockHeader->size_status &= ~(size_t)A_BIT;
+        blockHeader *previousFooter = freeBlockHeader - 1;
+        blockHeader *previousHeader = (blockHeader*)
+                ((char*)freeBlockHeader - previousFooter->size_status);
+        removeFree(arena, previousHeader);
+        size += blockSize(previousHeader);
+        prevBit = previousHeader->size_status & P_BIT;
+        freeBlockHeader = previousHeader;
+    }
+
+    freeBlockHeader->size_status = size + prevBit;
+    setPrevAllocated(nextBlock(freeBlockHeader), 0);
+    attachFree(arena, freeBlockHeader);
+
+    //trimming is batched so that frees next to a big free block do not
+    //each pay for a system call
+    if (trimThreshold != 0) {
+        arena->freedSinceTrim += freedSize;
+        if (arena->freedSinceTrim >= trimThreshold) {
+            trimArena(arena);
+        }
+    }
+}
+
+/*
+ * Releases every block parked on the arena's quick lists, coalescing them
+ * with their free neighbors.
+ * Callers in thread-safe mode must hold the arena's lock.
+ */
+static void consolidateQuick(heapArena *arena) {
+    int cls;
+    for (cls = 0; cls < QUICK_CLASSES; cls++) {
+        quickEntry *entry = arena->quick[cls];
+        arena->quick[cls] = NULL;
+        while (entry != NULL) {
+            quickEntry *next = entry->next;
+            entry->arena = NULL;
+            releaseBlock(arena, (blockHeader*)entry - 1);
+            entry = next;
+        }
+    }
+    arena->quickBytes = 0;
+}
+
+/*
+ * Parks an allocated block on its quick list when it is small enough and
+ * the quick lists stay within their budget, and releases it otherwise.
+ * Going over the budget consolidates the quick lists first.
+ * Callers in thread-safe mode must hold the arena's lock.
+ * Returns 0 on success.
+ * Returns -1 if the block is on a quick list already.
+ */
+static int quickFree(heapArena *arena, blockHeader *block) {
+    size_t size = blockSize(block);
+    if (size >= QUICK_LIMIT || quickBudget == 0 || arena->shared) {
+        releaseBlock(arena, block);
+        return 0;
+    }
+    quickEntry *entry = (quickEntry*)(block + 1);
+    int cls = size >> ALIGN_SHIFT;
+
+    //a parked block looks allocated, so check the list before trusting
+    //the arena mark to mean it was freed already
+    if (entry->arena == arena) {
+        quickEntry *parked;
+        for (parked = arena->quick[cls]; parked; parked = parked->next) {
+            if (parked == entry) {
+                return -1;
+            }
+        }
+    }
+    if (arena->quickBytes + size > quickBudget) {
+        consolidateQuick(arena);
+        releaseBlock(arena, block);
+        return 0;
+    }
+    entry->arena = arena;
+    entry->next = arena->quick[cls];
+    arena->quick[cls] = entry;
+    arena->quickBytes += size;
+    return 0;
+}
+
+/*
+ * Pushes the chain of blocks from first to last, linked through their
+ * entries, onto the arena's remote free queue without taking its lock.
+ */
+static void pushRemote(heapArena *arena, quickEntry *first, 
+        quickEntry *last) {
+    quickEntry *head = __atomic_load_n(&arena->remoteFrees, __ATOMIC_RELAXED);
+    do {
+        last->next = head;
+    } while (!__atomic_compare_exchange_n(&arena->remoteFrees, &head, first,
+            1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * Takes the whole remote free queue of the arena and frees its blocks.
+ * Callers must hold the arena's lock.
+ */
+static void drainRemote(heapArena *arena) {
+    quickEntry *entry = __atomic_exchange_n(&arena->remoteFrees, NULL,
+            __ATOMIC_ACQUIRE);
+    while (entry != NULL) {
+        quickEntry *next = entry->next;
+        entry->arena = NULL;
+        quickFree(arena, (blockHeader*)entry - 1);
+        entry = next;
+    }
+}
+
+/*
+ * Carves a block of exactly blockSz bytes out of the free block the
+ * placement policy picks, splitting off the tail as a new free block when
+ * it is big enough to stand alone. Falls back to the wilderness, which is
+ * all there is until something has been freed.
+ * Returns the header of the allocated block or NULL if nothing fits, with
+ * neither the quick lists consolidated nor the arena grown.
+ * Callers in thread-safe mode must hold the arena's lock.
+ */
+static blockHeader *carveBlock(heapArena *arena, size_t blockSz) {
+    blockHeader *freeBlock = NULL;
+    if (arena->binmapWords != 0 || arena->sizeTree != NULL) {
+        freeBlock = findFit(arena, blockSz);
+        //an arena laid out under best-fit keeps its large free blocks in
+        //the tree, where the other policies do not look
+        if (freeBlock == NULL && arena->sizeTree != NULL) {
+            freeBlock = treeFit(arena, blockSz);
+        }
+    }
+    if (freeBlock == NULL) {
+        return bumpWilderness(arena, blockSz);
+    }
+    removeFree(arena, freeBlock);
+
+    size_t freeSize = blockSize(freeBlock);
+    size_t remainder = freeSize - blockSz;
+    if (remainder >= MIN_BLOCK_SIZE) {
+        //split off the tail as a new free block whose previous block is
+        //the one we are handing out
+        freeBlock->size_status = blockSz + 
+                (freeBlock->size_status & P_BIT) + A_BIT;
+        blockHeader *newFreeHeader = nextBlock(freeBlock);
+        newFreeHeader->size_status = remainder + P_BIT;
+        attachFree(arena, newFreeHeader);
+    } else {
+        //too small to split so the whole block is used
+        freeBlock->size_status |= A_BIT;
+        setPrevAllocated(nextBlock(freeBlock), 1);
+    }
+    return freeBlock;
+}
+
+/*
+ * Releases the blocks on the arena's remote free queue first. Then hands
+ * out a block parked on the quick list of its exact size if there
+ * is one, and otherwise one from carveBlock. Falls back to consolidating
+ * the quick lists, and grows the arena when nothing fits after that.
+ * Returns the header of the allocated block or NULL if nothing fits.
+ * Callers in thread-safe mode must hold the arena's lock.
+ */
+static blockHeader *allocBlock(heapArena *arena, size_t blockSz) {
+    if (__atomic_load_n(&arena->remoteFrees, __ATOMIC_RELAXED) != NULL) {
+        drainRemote(arena);
+    }
+    if (blockSz < QUICK_LIMIT) {
+        quickEntry *entry = arena->quick[blockSz >> ALIGN_SHIFT];
+        if (entry != NULL) {
+            arena->quick[blockSz >> ALIGN_SHIFT] = entry->next;
+            arena->quickBytes -= blockSz;
+            entry->arena = NULL;
+            return (blockHeader*)entry - 1;
+        }
+    }
+    blockHeader *block = carveBlock(arena, blockSz);
+    if (block != NULL) {
+        return block;
+    }
+    //the parked blocks may coalesce into one that fits
+    if (arena->quickBytes != 0) {
+        consolidateQuick(arena);
+        return allocBlock(arena, blockSz);
+    }
+    if (growArena(arena, blockSz) != 0) {
+        return NULL;
+    }
+    return bumpWilderness(arena, blockSz);
+}
+
+/*
+ * Returns the first object of a slab.
+ */
+static inline char *slabObjects(slabHeader *slab) {
+    return (char*)slab - sizeof(heapSegment) + SLAB_OBJECTS;
+}
+
+/*
+ * Returns the slab holding ptr, or NULL if ptr is not in a chunk of slabs.
+ */
+static slabHeader *slabOf(void *ptr) {
+    heapSegment *segment = lookupSegment(ptr);
+    if (segment == NULL || segment->start != NULL) {
+        return NULL;
+    }
+    return (slabHeader*)(((uintptr_t)ptr & ~(SLAB_SIZE - 1)) + 
+            sizeof(heapSegment));
+}
+
+/*
+ * Returns the number of the object at ptr within its slab, or -1 if ptr
+ * is not the start of an object.
+ */
+static long slabIndex(slabHeader *slab, void *ptr) {
+    char *objects = slabObjects(slab);
+    if ((char*)ptr < objects) {
+        return -1;
+    }
+    size_t offset = (char*)ptr - objects;
+    if (offset % slab->objSize != 0 || 
+            offset / slab->objSize >= slab->objCount) {
+        return -1;
+    }
+    return offset / slab->objSize;
+}
+
+/*
+ * The free maps are read without a lock by freeHeap in thread-safe mode,
+ * so their words are only ever stored whole.
+ */
+static inline void setFreeMap(unsigned long *word, unsigned long bits) {
+    __atomic_store_n(word, bits, __ATOMIC_RELAXED);
+}
+
+static void pushSlab(heapArena *arena, slabHeader *slab) {
+    int cls = slab->objSize >> ALIGN_SHIFT;
+    slab->prev = NULL;
+    slab->next = arena->slabs[cls];
+    if (slab->next != NULL) {
+        slab->next->prev = slab;
+    }
+    arena->slabs[cls] = slab;
+}
+
+static void unlinkSlab(heapArena *arena, slabHeader *slab) {
+    if (slab->prev != NULL) {
+        slab->prev->next = slab->next;
+    } else {
+        arena->slabs[slab->objSize >> ALIGN_SHIFT] = slab->next;
+    }
+    if (slab->next != NULL) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+/*
+ * Sets up an empty slab of objSize byte objects and puts it on the
+ * arena's list for that class. The slab is a spare one if there is any,
+ * otherwise it is cut from the arena's newest chunk of slabs, and a chunk
+ * is mapped when that one is used up.
+ * Callers in thread-safe mode must hold the arena's lock.
+ * Returns the slab or NULL if no chunk can be mapped.
+ */
+static slabHeader *newSlab(heapArena *arena, size_t objSize) {
+    slabHeader *slab = arena->spareSlabs;
+    int i;
+
+    if (slab != NULL) {
+        arena->spareSlabs = slab->next;
+    } else {
+        if (arena->slabNext == NULL || 
+                arena->slabNext == (char*)arena->slabChunks + CHUNK_SIZE) {
+            char *base = mapAligned(CHUNK_SIZE, CHUNK_SIZE, 0);
+            if (base == NULL) {
+                return NULL;
+            }
+            heapSegment *chunk = (heapSegment*)base;
+            chunk->arena = arena;
+            chunk->start = NULL;
+            chunk->size = CHUNK_SIZE;
+            if (registerSegment(chunk, base, CHUNK_SIZE) != 0) {
+                munmap(base, CHUNK_SIZE);
+                return NULL;
+            }
+            chunk->next = arena->slabChunks;
+            arena->slabChunks = chunk;
+            arena->slabNext = base;
+            __atomic_fetch_add(&slabMapped, CHUNK_SIZE, __ATOMIC_RELAXED);
+        }
+        slab = (slabHeader*)(arena->slabNext + sizeof(heapSegment));
+        arena->slabNext += SLAB_SIZE;
+    }
+
+    slab->arena = arena;
+    slab->objSize = objSize;
+    slab->objCount = (SLAB_SIZE - SLAB_OBJECTS) / objSize;
+    slab->freeCount = slab->objCount;
+    for (i = 0; i < SLAB_MAP_WORDS; i++) {
+        unsigned int first = i * SLAB_MAP_BITS;
+        if (first + SLAB_MAP_BITS <= slab->objCount) {
+            setFreeMap(&slab->freeMap[i], ~0UL);
+        } else if (first < slab->objCount) {
+            setFreeMap(&slab->freeMap[i], 
+                    (1UL << (slab->objCount - first)) - 1);
+        } else {
+            setFreeMap(&slab->freeMap[i], 0);
+        }
+    }
+    pushSlab(arena, slab);
+    return slab;
+}
+
+/*
+ * Takes the lowest free object of objSize bytes from the arena's slabs.
+ * Callers in thread-safe mode must hold the arena's lock.
+ * Returns the object or NULL if no slab can be set up.
+ */
+static void *slabAlloc(heapArena *arena, size_t objSize) {
+    slabHeader *slab = arena->slabs[objSize >> ALIGN_SHIFT];
+    if (slab == NULL) {
+        slab = newSlab(arena, objSize);
+        if (slab == NULL) {
+            return NULL;
+        }
+    }
+    int word = 0;
+    while (slab->freeMap[word] == 0) {
+        word++;
+    }
+    unsigned long bits = slab->freeMap[word];
+    setFreeMap(&slab->freeMap[word], bits & (bits - 1));
+    //a full slab leaves the list until one of its objects is freed
+    if (--slab->freeCount == 0) {
+        unlinkSlab(arena, slab);
+    }
+    return slabObjects(slab) + 
+            (size_t)(word * SLAB_MAP_BITS + __builtin_ctzl(bits)) * objSize;
+}
+
+/*
+ * Gives an object back to its slab. A slab that becomes empty is kept
+ * for its class if it is the only one there, otherwise it becomes a spare.
+ * Callers in thread-safe mode must hold the lock of the slab's arena.
+ * Returns 0 on success.
+ * Returns -1 if ptr is not an allocated object of the slab.
+ */
+static int slabFree(slabHeader *slab, void *ptr) {
+    heapArena *arena = slab->arena;
+    long idx = slabIndex(slab, ptr);
+    if (idx < 0) {
+        return -1;
+    }
+    unsigned long *word = &slab->freeMap[idx / SLAB_MAP_BITS];
+    unsigned long mask = 1UL << (idx % SLAB_MAP_BITS);
+    if (*word & mask) {
+        return -1;
+    }
+    setFreeMap(word, *word | mask);
+
+    if (slab->freeCount++ == 0) {
+        pushSlab(arena, slab);
+    } else if (slab->freeCount == slab->objCount && 
+            (slab->prev != NULL || slab->next != NULL)) {
+        unlinkSlab(arena, slab);
+        slab->next = arena->spareSlabs;
+        arena->spareSlabs = slab;
+    }
+    return 0;
+}
+
+static inline void lockArena(heapArena *arena) {
+    if (threadSafe || arena->processShared) {
+        //only robust locks report an owner that died holding them
+        if (pthread_mutex_lock(&arena->lock) == EOWNERDEAD) {
+            pthread_mutex_consistent(&arena->lock);
+        }
+    }
+}
+
+static inline void unlockArena(heapArena *arena) {
+    if (threadSafe || arena->processShared) {
+        pthread_mutex_unlock(&arena->lock);
+    }
+}
+
+/*
+ * Returns the arena the calling thread should allocate from.
+ */
+static heapArena *pickArena() {
+    if (numArenas == 1) {
+        return &arenas[0];
+    }
+    if (arenaByCpu) {
+        int cpu = sched_getcpu();
+        if (cpu >= 0) {
+            return &arenas[cpu % numArenas];
+        }
+    }
+    if (threadArena == NULL) {
+        unsigned int idx = __atomic_fetch_add(&nextArena, 1, __ATOMIC_RELAXED);
+        threadArena = &arenas[idx % numArenas];
+    }
+    return threadArena;
+}
+
+/*
+ * Returns the arena whose block chain holds ptr, or NULL if ptr cannot be
+ * the payload of a block in any of them.
+ */
+static heapArena *ownerArena(void *ptr) {
+    heapSegment *segment;
+    if ((char*)ptr >= regionStart && 
+            (char*)ptr < regionStart + numArenas * arenaSpan) {
+        segment = &arenas[((char*)ptr - regionStart) / arenaSpan].first;
+        //buddy blocks have no header in front of them
+        if (buddyEngine) {
+            return (char*)ptr >= (char*)segment->start &&
+                    (char*)ptr < (char*)segment->start + segment->size ?
+                    segment->arena : NULL;
+        }
+    } else {
+        segment = lookupSegment(ptr);
+        if (segment == NULL) {
+            return NULL;
+        }
+    }
+    if (segment->start == NULL || (blockHeader*)ptr <= segment->start || 
+            (char*)ptr > (char*)segment->start + segment->size) {
+        return NULL;
+    }
+    return segment->arena;
+}
+
+/*
+ * Allocates a block of blockSz bytes from the calling thread's arena, 
+ * moving on to the others in turn when that one is full.
+ */
+static blockHeader *allocFromArenas(size_t blockSz) {
+    heapArena *home = pickArena();
+    heapArena *arena = home;
+    do {
+        lockArena(arena);
+        blockHeader *block = allocBlock(arena, blockSz);
+        unlockArena(arena);
+        if (block != NULL) {
+            return block;
+        }
+        if (++arena == arenas + numArenas) {
+            arena = arenas;
+        }
+    } while (arena != home);
+    return NULL;
+}
+
+/*
+ * The buddy engine's allocFromArenas, returns a block of at least size
+ * bytes or NULL. A non-zero align asks for an address that is a multiple
+ * of it on top of the buddy alignment.
+ */
+static void *allocFromBuddies(size_t size, size_t align) {
+    heapArena *home = pickArena();
+    heapArena *arena = home;
+    do {
+        lockArena(arena);
+        void *ptr = align == 0 ? buddyAlloc(&arena->buddy, size) : 
+                buddyAllocAligned(&arena->buddy, size, align);
+        unlockArena(arena);
+        if (ptr != NULL) {
+            return ptr;
+        }
+        if (++arena == arenas + numArenas) {
+            arena = arenas;
+        }
+    } while (arena != home);
+    return NULL;
+}
+
+/*
+ * Hands the blocks or slab objects cached for list cls back to the heap,
+ * starting at entry. Blocks of other arenas than the calling thread's go
+ * on their remote free queues, and consecutive ones from the same arena
+ * are released under one acquisition of its lock.
+ */
+static void releaseCacheEntries(cacheEntry *entry, int cls) {
+    heapArena *home = pickArena();
+    heapArena *locked = NULL;
+    while (entry != NULL) {
+        cacheEntry *next = entry->next;
+        slabHeader *slab = cls < CACHE_CLASSES ? NULL : slabOf(entry);
+        heapArena *arena = slab != NULL ? slab->arena : ownerArena(entry);
+        if (slab == NULL && arena != home) {
+            quickEntry *remote = (quickEntry*)entry;
+            remote->arena = arena;
+            pushRemote(arena, remote, remote);
+            entry = next;
+            continue;
+        }
+        if (arena != locked) {
+            if (locked != NULL) {
+                pthread_mutex_unlock(&locked->lock);
+            }
+            pthread_mutex_lock(&arena->lock);
+            locked = arena;
+        }
+        if (slab != NULL) {
+            slabFree(slab, entry);
+        } else {
+            quickFree(arena, (blockHeader*)entry - 1);
+        }
+        entry = next;
+    }
+    if (locked != NULL) {
+        pthread_mutex_unlock(&locked->lock);
+    }
+}
+
+/*
+ * Thread exit destructor, returns everything the thread still has cached.
+ * The destructor is disarmed by running, so the cache is marked as such:
+ * a free from a later destructor arms it again for another round.
+ */
+static void flushThreadCache(void *arg) {
+    threadCache *cache = arg;
+    int cls;
+    cache->registered = 0;
+    for (cls = 0; cls < CACHE_LISTS; cls++) {
+        releaseCacheEntries(cache->lists[cls], cls);
+        cache->lists[cls] = NULL;
+        cache->counts[cls] = 0;
+    }
+}
+
+/*
+ * Makes sure flushThreadCache runs when the calling thread exits.
+ */
+static inline void armThreadCache(threadCache *cache) {
+    if (!cache->registered) {
+        //the key only holds a non-NULL value so the destructor gets to run
+        pthread_setspecific(tcacheKey, cache);
+        cache->registered = 1;
+    }
+}
+
+/*
+ * Allocates up to CACHE_BATCH blocks or slab objects for cache list cls
+ * under a single acquisition of an arena lock, trying the other arenas
+ * when the calling thread's own one is full, and links them onto *list.
+ * Returns the number of entries added.
+ */
+static int takeEntries(int cls, cacheEntry **list) {
+    heapArena *home = pickArena();
+    heapArena *arena = home;
+    int added = 0;
+    do {
+        pthread_mutex_lock(&arena->lock);
+        while (added < CACHE_BATCH) {
+            cacheEntry *entry;
+            if (cls < CACHE_CLASSES) {
+                blockHeader *block = allocBlock(arena, 
+                        (size_t)cls << ALIGN_SHIFT);
+                entry = block == NULL ? NULL : (cacheEntry*)(block + 1);
+            } else {
+                entry = slabAlloc(arena, 
+                        (size_t)(cls - CACHE_CLASSES) << ALIGN_SHIFT);
+            }
+            if (entry == NULL) {
+                break;
+            }
+            entry->next = *list;
+            *list = entry;
+            added++;
+        }
+        pthread_mutex_unlock(&arena->lock);
+        if (++arena == arenas + numArenas) {
+            arena = arenas;
+        }
+    } while (added == 0 && arena != home);
+    return added;
+}
+
+/*
+ * Refills one list of the calling thread's cache with a batch from
+ * takeEntries.
+ * Returns the number of entries added.
+ */
+static int refillThreadCache(int cls) {
+    threadCache *cache = &tcache;
+    armThreadCache(cache);
+    int added = takeEntries(cls, &cache->lists[cls]);
+    cache->counts[cls] += added;
+    return added;
+}
+
+#ifdef HAVE_RSEQ
+/*
+ * Pops an entry off list cls of the calling CPU's cache in a restartable
+ * sequence. Label 3 is the sequence's descriptor, 1 to 2 the sequence
+ * itself with the count store as its commit, and 4 the abort handler,
+ * which starts over from 0 because the kernel clears the descriptor
+ * pointer on abort.
+ * Returns the entry or NULL if the list is empty.
+ */
+static inline void *cpuPop(int cls) {
+    struct rseq *rs = (struct rseq*)
+            ((char*)__builtin_thread_pointer() + __rseq_offset);
+    void *entry;
+    __asm__ __volatile__(
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0, 0\n\t"
+        ".quad 1f, 2f - 1f, 4f\n\t"
+        ".popsection\n\t"
+        "0:\n\t"
+        "leaq 3b(%%rip), %%rax\n\t"
+        "movq %%rax, %c[csField](%[rs])\n\t"
+        "1:\n\t"
+        "xorl %k[entry], %k[entry]\n\t"
+        "movl %c[cpuField](%[rs]), %%eax\n\t"
+        "imulq %[stride], %%rax, %%rax\n\t"
+        "addq %[caches], %%rax\n\t"
+        "movl (%%rax, %[cls], 4), %%ecx\n\t"
+        "testl %%ecx, %%ecx\n\t"
+        "jz 2f\n\t"
+        "decl %%ecx\n\t"
+        "leaq (%[first], %%rcx), %%rdx\n\t"
+        "movq %c[slots](%%rax, %%rdx, 8), %[entry]\n\t"
+        "movl %%ecx, (%%rax, %[cls], 4)\n\t"
+        "2:\n\t"
+        "jmp 5f\n\t"
+        ".long %c[sig]\n\t"
+        "4:\n\t"
+        "jmp 0b\n\t"
+        "5:\n\t"
+        : [entry] "=&r" (entry)
+        : [rs] "r" (rs), [caches] "r" (cpuCaches), [cls] "r" ((long)cls),
+          [first] "r" ((long)cls * CPU_SLOTS),
+          [stride] "i" (sizeof(cpuCache)),
+          [slots] "i" (offsetof(cpuCache, slots)),
+          [csField] "i" (offsetof(struct rseq, rseq_cs)),
+          [cpuField] "i" (offsetof(struct rseq, cpu_id)),
+          [sig] "i" (RSEQ_SIG)
+        : "rax", "rcx", "rdx", "memory", "cc");
+    return entry;
+}
+
+/*
+ * Pushes an entry onto list cls of the calling CPU's cache in a
+ * restartable sequence laid out like cpuPop's.
+ * Returns 0 on success, -1 if the list is full.
+ */
+static inline int cpuPush(int cls, void *entry) {
+    struct rseq *rs = (struct rseq*)
+            ((char*)__builtin_thread_pointer() + __rseq_offset);
+    int full;
+    __asm__ __volatile__(
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0, 0\n\t"
+        ".quad 1f, 2f - 1f, 4f\n\t"
+        ".popsection\n\t"
+        "0:\n\t"
+        "leaq 3b(%%rip), %%rax\n\t"
+        "movq %%rax, %c[csField](%[rs])\n\t"
+        "1:\n\t"
+        "movl $1, %[full]\n\t"
+        "movl %c[cpuField](%[rs]), %%eax\n\t"
+        "imulq %[stride], %%rax, %%rax\n\t"
+        "addq %[caches], %%rax\n\t"
+        "movl (%%rax, %[cls], 4), %%ecx\n\t"
+        "cmpl %[max], %%ecx\n\t"
+        "jae 2f\n\t"
+        "leaq (%[first], %%rcx), %%rdx\n\t"
+        "movq %[entry], %c[slots](%%rax, %%rdx, 8)\n\t"
+        "incl %%ecx\n\t"
+        "xorl %[full], %[full]\n\t"
+        "movl %%ecx, (%%rax, %[cls], 4)\n\t"
+        "2:\n\t"
+        "jmp 5f\n\t"
+        ".long %c[sig]\n\t"
+        "4:\n\t"
+        "jmp 0b\n\t"
+        "5:\n\t"
+        : [full] "=&r" (full)
+        : [rs] "r" (rs), [caches] "r" (cpuCaches), [cls] "r" ((long)cls),
+          [first] "r" ((long)cls * CPU_SLOTS), [entry] "r" (entry),
+          [stride] "i" (sizeof(cpuCache)), [max] "i" (CPU_SLOTS),
+          [slots] "i" (offsetof(cpuCache, slots)),
+          [csField] "i" (offsetof(struct rseq, rseq_cs)),
+          [cpuField] "i" (offsetof(struct rseq, cpu_id)),
+          [sig] "i" (RSEQ_SIG)
+        : "rax", "rcx", "rdx", "memory", "cc");
+    return full ? -1 : 0;
+}
+#else
+static inline void *cpuPop(int cls) {
+    return NULL;
+}
+
+static inline int cpuPush(int cls, void *entry) {
+    return -1;
+}
+#endif
+
+/*
+ * Maps the per-CPU caches, as long as the kernel runs restartable
+ * sequences for this build and glibc registered them for every thread.
+ * Returns the caches or NULL to keep the thread caches.
+ */
+static cpuCache *mapCpuCaches() {
+#ifdef HAVE_RSEQ
+    numCpus = sysconf(_SC_NPROCESSORS_CONF);
+    if (__rseq_size == 0 || numCpus < 1) {
+        return NULL;
+    }
+    //untouched caches of idle CPUs cost no memory
+    void *caches = mmap(NULL, numCpus * sizeof(cpuCache), 
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return caches == MAP_FAILED ? NULL : caches;
+#else
+    return NULL;
+#endif
+}
+
+/*
+ * Returns 1 if ptr sits on list cls of any CPU's cache, 0 otherwise. The
+ * lists are read without owning their CPUs, which is enough to catch a
+ * block freed twice unless it is on its way between a cache and the heap.
+ */
+static int cpuCached(int cls, void *ptr) {
+    long cpu;
+    for (cpu = 0; cpu < numCpus; cpu++) {
+        cpuCache *cache = &cpuCaches[cpu];
+        unsigned int n = __atomic_load_n(&cache->counts[cls],
+                __ATOMIC_RELAXED);
+        unsigned int i;
+        for (i = 0; i < n && i < CPU_SLOTS; i++) {
+            if (__atomic_load_n(&cache->slots[cls][i], 
+                    __ATOMIC_RELAXED) == ptr) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Pops an entry off list cls of the calling CPU's cache. An empty list
+ * gets a batch from takeEntries, one entry of which goes straight to the
+ * caller.
+ * Returns the entry or NULL if nothing could be allocated.
+ */
+static void *takeCpuCached(int cls) {
+    cacheEntry *entry = cpuPop(cls);
+    if (entry == NULL) {
+        cacheEntry *batch = NULL;
+        if (takeEntries(cls, &batch) == 0) {
+            return NULL;
+        }
+        entry = batch;
+        batch = batch->next;
+        //the next link is read first since a pushed entry may be taken
+        //by another thread right away
+        while (batch != NULL) {
+            cacheEntry *next = batch->next;
+            batch->owner = CPU_OWNER;
+            if (cpuPush(cls, batch) != 0) {
+                break;
+            }
+            batch = next;
+        }
+        //another thread on this CPU filled the list meanwhile
+        releaseCacheEntries(batch, cls);
+    }
+    entry->owner = NULL;
+    return entry;
+}
+
+/*
+ * Pushes a freed block or slab object onto list cls of the calling CPU's
+ * cache. A full list first gives CACHE_BATCH of its entries back to the
+ * heap.
+ * Returns 0 on success.
+ * Returns -1 if ptr is on a CPU's cache already.
+ */
+static int cpuCacheFree(int cls, void *ptr) {
+    cacheEntry *entry = ptr;
+    if (entry->owner == CPU_OWNER && cpuCached(cls, ptr)) {
+        return -1;
+    }
+    entry->owner = CPU_OWNER;
+    while (cpuPush(cls, entry) != 0) {
+        cacheEntry *batch = NULL;
+        int taken;
+        for (taken = 0; taken < CACHE_BATCH; taken++) {
+            cacheEntry *old = cpuPop(cls);
+            if (old == NULL) {
+                break;
+            }
+            old->next = batch;
+            batch = old;
+        }
+        releaseCacheEntries(batch, cls);
+    }
+    return 0;
+}
+
+/*
+ * Pops an entry off one list of the calling thread's cache, refilling the
+ * list first if it is empty, or off the calling CPU's cache instead.
+ * Returns the entry or NULL if the list cannot be refilled.
+ */
+static void *takeCached(int cls) {
+    if (cpuCaches != NULL) {
+        return takeCpuCached(cls);
+    }
+    threadCache *cache = &tcache;
+    if (cache->lists[cls] == NULL && refillThreadCache(cls) == 0) {
+        return NULL;
+    }
+    cacheEntry *entry = cache->lists[cls];
+    cache->lists[cls] = entry->next;
+    cache->counts[cls]--;
+    entry->owner = NULL;
+    return entry;
+}
+
+/*
+ * Parks a freed block or slab object on one list of the calling thread's
+ * cache. Once the list is full the CACHE_BATCH most recently freed entries
+ * are kept and the older ones given back in one go. With per-CPU caches
+ * the entry goes on the calling CPU's cache instead.
+ * Returns 0 on success.
+ * Returns -1 if ptr is already on the list.
+ */
+static int cacheFree(int cls, void *ptr) {
+    if (cpuCaches != NULL) {
+        return cpuCacheFree(cls, ptr);
+    }
+    threadCache *cache = &tcache;
+    cacheEntry *entry = ptr;
+
+    //a cached entry looks allocated, so check our own list before
+    //trusting the owner mark to mean it was freed already
+    if (entry->owner == cache) {
+        cacheEntry *cached;
+        for (cached = cache->lists[cls]; cached; cached = cached->next) {
+            if (cached == entry) {
+                return -1;
+            }
+        }
+    }
+    armThreadCache(cache);
+    entry->owner = cache;
+    entry->next = cache->lists[cls];
+    cache->lists[cls] = entry;
+
+    if (++cache->counts[cls] > CACHE_MAX) {
+        cacheEntry *last = entry;
+        int kept;
+        for (kept = 1; kept < CACHE_BATCH; kept++) {
+            last = last->next;
+        }
+        releaseCacheEntries(last->next, cls);
+        last->next = NULL;
+        cache->counts[cls] = CACHE_BATCH;
+    }
+    return 0;
+}
+
+/*
+ * Frees an object of a slab, through the thread cache in thread-safe
+ * mode. The object's bit in the free map is read without a lock there,
+ * which is safe because only the thread freeing an object may change it.
+ * Returns 0 on success.
+ * Returns -1 if ptr is not an allocated object.
+ */
+static int freeSlabObject(slabHeader *slab, void *ptr) {
+    if (!threadSafe) {
+        return slabFree(slab, ptr);
+    }
+    long idx = slabIndex(slab, ptr);
+    if (idx < 0 || (__atomic_load_n(&slab->freeMap[idx / SLAB_MAP_BITS],
+            __ATOMIC_RELAXED) & (1UL << (idx % SLAB_MAP_BITS))) != 0) {
+        return -1;
+    }
+    return cacheFree(CACHE_CLASSES + (slab->objSize >> ALIGN_SHIFT), ptr);
+}
+ 
+/* 
+ * Function for allocating 'size' bytes of heap memory.
+ * Argument size: requested size for the payload
+ * Returns address of allocated block on success.
+ * Returns NULL on failure.
+ * This function should:
+ * - Check size - Return NULL if not positive or if larger than heap space.
+ * - Determine block size rounding up to a multiple of 8 (16 in 64-bit builds)
+ *   and possibly adding padding as a result.
+ * - Use SEGREGATED FIT PLACEMENT POLICY to chose a free block
+ * - Use SPLITTING to divide the chosen free block into two if it is too large.
+ * - Update header(s) and footer as needed.
+ * Requests of at least HEAP_OPT_MMAP_THRESHOLD bytes get their own mapping,
+ * requests of up to HEAP_OPT_SLAB_LIMIT bytes come from slabs.
+ * In thread-safe mode small requests are served from the calling thread's
+ * cache without taking a lock.
+ * Tips: Be careful with pointer arithmetic and scale factors.
+ */
+void* allocHeap(size_t size) {     
+    if (size == 0 || size > MAX_REQUEST) {
+        return NULL;
+    }
+    if (mmapThreshold != 0 && size >= mmapThreshold) {
+        return allocDirect(size, ALIGNMENT);
+    }
+    //blocks take over if no slab can be set up
+    if (size <= slabLimit) {
+        size_t objSize = ALIGN_UP(size);
+        void *ptr;
+        if (threadSafe) {
+            ptr = takeCached(CACHE_CLASSES + (objSize >> ALIGN_SHIFT));
+        } else {
+            ptr = slabAlloc(pickArena(), objSize);
+        }
+        if (ptr != NULL) {
+            return ptr;
+        }
+    }
+    //if size is larger than the heap there is nothing to do, a growing heap
+    //is only limited by the largest segment it can map
+    if (growSize == 0 && size > allocsize) {
+        return NULL;
+    }
+    if (buddyEngine) {
+        return allocFromBuddies(size, 0);
+    }
+
+    size_t blockSz = blockSizeFor(size);
+
+    if (threadSafe && blockSz < CACHE_LIMIT) {
+        return takeCached(blockSz >> ALIGN_SHIFT);
+    }
+
+    blockHeader *block = allocFromArenas(blockSz);
+    return block == NULL ? NULL : (void*)(block + 1);
+} 
+ 
+/* 
+ * Function for freeing up a previously allocated block.
+ * Argument ptr: address of the block to be freed up.
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ * This function should:
+ * - Return -1 if ptr is NULL.
+ * - Return -1 if ptr is not a multiple of 8 (16 in 64-bit builds).
+ * - Return -1 if ptr is outside of the heap space.
+ * - Return -1 if ptr block is already freed.
+ * - USE IMMEDIATE COALESCING if one or both of the adjacent neighbors are free.
+ * - Update header(s) and footer as needed.
+ * In thread-safe mode small blocks are parked in the calling thread's cache
+ * and only handed back to their arena in batches, and blocks of another
+ * arena than the calling thread's go on its remote free queue.
+ */                    
+int freeHeap(void *ptr) {    
+    //makes sure the pointer to be freed is not null
+    if (ptr == NULL) {
+        return -1;
+    }
+    //make sure the pointer to be freed is aligned
+    if ((uintptr_t)ptr % ALIGNMENT != 0) {
+        return -1;
+    }
+    //makes sure the pointer is insdie the memory range of some arena,
+    //otherwise it can only be a slab object or a block with a mapping of
+    //its own
+    heapArena *arena = ownerArena(ptr);
+    if (arena == NULL) {
+        slabHeader *slab = slabOf(ptr);
+        return slab != NULL ? freeSlabObject(slab, ptr) : freeDirect(ptr);
+    }
+    if (buddyEngine) {
+        lockArena(arena);
+        size_t freed = buddyFree(&arena->buddy, ptr);
+        if (freed != 0 && trimThreshold != 0) {
+            arena->freedSinceTrim += freed;
+            if (arena->freedSinceTrim >= trimThreshold) {
+                trimArena(arena);
+            }
+        }
+        unlockArena(arena);
+        return freed != 0 ? 0 : -1;
+    }
+
+    blockHeader *freeBlockHeader = (blockHeader*)ptr - 1;
+    size_t sizeStatus = __atomic_load_n(&freeBlockHeader->size_status,
+            __ATOMIC_RELAXED);
+
+    //pointer to be freed is already freed
+    if ((sizeStatus & A_BIT) == 0) {
+        return -1;
+    }
+
+    size_t size = sizeStatus & SIZE_MASK;
+    if (threadSafe && size < CACHE_LIMIT) {
+        return cacheFree(size >> ALIGN_SHIFT, ptr);
+    }
+
+    //a block marked with its arena may be queued or parked already, which
+    //only the lock holder can tell
+    quickEntry *entry = ptr;
+    if (threadSafe && arena != pickArena() && entry->arena != arena) {
+        entry->arena = arena;
+        pushRemote(arena, entry, entry);
+        return 0;
+    }
+    lockArena(arena);
+    if (entry->arena == arena) {
+        drainRemote(arena);
+    }
+    int ret = (freeBlockHeader->size_status & A_BIT) == 0 ? -1 :
+            quickFree(arena, freeBlockHeader);
+    unlockArena(arena);
+
+    return ret;
+} 
+
+/*
+ * Function for allocating several blocks of the same size at once.
+ * Argument size: requested size for each payload.
+ * Argument n: number of blocks wanted.
+ * Argument out: array of at least n pointers that receives the blocks.
+ * Returns the number of blocks stored in out, which is less than n only
+ * when the heap runs out of space.
+ * Arena blocks are carved from a single free block under one acquisition
+ * of the arena lock when the arena has one big enough for all of them.
+ * Each block may be freed on its own with freeHeap.
+ */
+size_t allocHeapBatch(size_t size, size_t n, void **out) {
+    size_t count = 0;
+    if (size == 0 || size > MAX_REQUEST) {
+        return 0;
+    }
+    //slab objects, mappings and buddies are cheap enough one at a time
+    if ((mmapThreshold != 0 && size >= mmapThreshold) || 
+            size <= slabLimit || buddyEngine) {
+        while (count < n && (out[count] = allocHeap(size)) != NULL) {
+            count++;
+        }
+        return count;
+    }
+    if (growSize == 0 && size > allocsize) {
+        return 0;
+    }
+
+    size_t blockSz = blockSizeFor(size);
+    heapArena *home = pickArena();
+    heapArena *arena = home;
+    do {
+        lockArena(arena);
+        size_t left = n - count;
+        //the run only comes out of space the arena has already, the
+        //single blocks below consolidate and grow if need be
+        blockHeader *block = left > 1 && left <= MAX_REQUEST / blockSz ?
+                carveBlock(arena, left * blockSz) : NULL;
+        if (block != NULL) {
+            //cut it up, the last block keeps any slack allocBlock left
+            size_t slack = blockSize(block) - left * blockSz;
+            size_t prevBit = block->size_status & P_BIT;
+            for (; count < n; count++) {
+                block->size_status = blockSz + prevBit + A_BIT;
+                if (count == n - 1) {
+                    block->size_status += slack;
+                }
+                out[count] = block + 1;
+                block = nextBlock(block);
+                prevBit = P_BIT;
+            }
+        }
+        while (count < n && (block = allocBlock(arena, blockSz)) != NULL) {
+            out[count++] = block + 1;
+        }
+        unlockArena(arena);
+        if (++arena == arenas + numArenas) {
+            arena = arenas;
+        }
+    } while (count < n && arena != home);
+    return count;
+}
+
+/*
+ * Sorts pointers by address, quicksort down to short runs that insertion
+ * sort finishes. Comparing inline makes it a few times faster than qsort
+ * here, and it never calls into the heap. Recursing only into the smaller
+ * side bounds the stack depth.
+ */
+static void sortAddresses(void **ptrs, size_t n) {
+    while (n > 16) {
+        void *pivot = ptrs[n / 2];
+        size_t i = 0;
+        size_t j = n - 1;
+        for (;;) {
+            while (ptrs[i] < pivot) {
+                i++;
+            }
+            while (ptrs[j] > pivot) {
+                j--;
+            }
+            if (i >= j) {
+                break;
+            }
+            void *swap = ptrs[i];
+            ptrs[i++] = ptrs[j];
+            ptrs[j--] = swap;
+        }
+        //ptrs[0..j] are at most pivot and the rest at least pivot
+        if (j + 1 < n - j - 1) {
+            sortAddresses(ptrs, j + 1);
+            ptrs += j + 1;
+            n -= j + 1;
+        } else {
+            sortAddresses(ptrs + j + 1, n - j - 1);
+            n = j + 1;
+        }
+    }
+    size_t i;
+    for (i = 1; i < n; i++) {
+        void *ptr = ptrs[i];
+        size_t j = i;
+        for (; j > 0 && ptrs[j - 1] > ptr; j--) {
+            ptrs[j] = ptrs[j - 1];
+        }
+        ptrs[j] = ptr;
+    }
+}
+
+/*
+ * Function for freeing several blocks at once.
+ * Argument ptrs: addresses of the blocks to be freed up, which are
+ * sorted by address in place.
+ * Argument n: number of addresses in ptrs.
+ * Returns 0 on success.
+ * Returns -1 if any of the addresses could not be freed, as freeHeap
+ * would. The others are still freed.
+ * Runs of arena blocks that lie next to each other are merged into one
+ * block and coalesced in a single step, and consecutive blocks of the
+ * same arena are freed under one acquisition of its lock.
+ */
+int freeHeapBatch(void **ptrs, size_t n) {
+    heapArena *locked = NULL;
+    int ret = 0;
+    size_t i = 0;
+
+    //batches from allocHeapBatch usually come back in order
+    for (i = 1; i < n; i++) {
+        if (ptrs[i - 1] > ptrs[i]) {
+            sortAddresses(ptrs, n);
+            break;
+        }
+    }
+    i = 0;
+    while (i < n) {
+        void *ptr = ptrs[i++];
+        if (i > 1 && ptr == ptrs[i - 2] && ptr != NULL) {
+            //the same address twice is a double free
+            ret = -1;
+            continue;
+        }
+        heapArena *arena = NULL;
+        if (ptr != NULL && (uintptr_t)ptr % ALIGNMENT == 0 && !buddyEngine) {
+            arena = ownerArena(ptr);
+        }
+        if (arena != locked && locked != NULL) {
+            unlockArena(locked);
+            locked = NULL;
+        }
+        if (arena == NULL) {
+            if (freeHeap(ptr) != 0) {
+                ret = -1;
+            }
+            continue;
+        }
+        if (locked == NULL) {
+            lockArena(arena);
+            drainRemote(arena);
+            locked = arena;
+        }
+
+        blockHeader *block = (blockHeader*)ptr - 1;
+        if ((block->size_status & A_BIT) == 0) {
+            ret = -1;
+            continue;
+        }
+        //absorb the blocks after it as long as they come next in ptrs,
+        //leaving out any that may be parked on a quick list already, an
+        //absorbed header must stop looking allocated or a second free of
+        //it would go through
+        size_t size = blockSize(block);
+        while (i < n && (blockHeader*)ptrs[i] - 1 == nextBlock(block) &&
+                ((quickEntry*)ptr)->arena != arena) {
+            blockHeader *next = nextBlock(block);
+            if (blockSize(next) == 0 || (next->size_status & A_BIT) == 0 ||
+                    ((quickEntry*)ptrs[i])->arena == arena) {
+                break;
+            }
+            next->size_status &= ~(size_t)A_BIT;
+            size += blockSize(next);
+            block->size_status = size + (block->size_status & P_BIT) + 
+                    A_BIT;
+            i++;
+        }
+        if (quickFree(arena, block) != 0) {
+            ret = -1;
+        }
+    }
+    if (locked != NULL) {
+        unlockArena(locked);
+    }
+    return ret;
+}
+
+/*
+ * Resizes an arena block to blockSz bytes without moving it, either by
+ * splitting off its tail or by absorbing the free block after it.
+ * Callers in thread-safe mode must hold the arena's lock.
+ * Returns 0 on success.
+ * Returns -1 if the block cannot be resized in place.
+ */
+static int resizeBlock(heapArena *arena, blockHeader *block, 
+        size_t blockSz) {
+    size_t size = blockSize(block);
+    size_t bits = block->size_status & (A_BIT | P_BIT);
+
+    if (blockSz <= size) {
+        //shrink, the tail goes through releaseBlock so that it coalesces
+        //with a free block after it
+        if (size - blockSz >= MIN_BLOCK_SIZE) {
+            block->size_status = blockSz + bits;
+            blockHeader *tail = nextBlock(block);
+            tail->size_status = (size - blockSz) + P_BIT + A_BIT;
+            releaseBlock(arena, tail);
+        }
+        return 0;
+    }
+
+    //grow, only possible when the next block is free and big enough
+    blockHeader *next = nextBlock(block);
+    if ((next->size_status & A_BIT) != 0 || 
+            size + blockSize(next) < blockSz) {
+        return -1;
+    }
+    detachFree(arena, next);
+    size += blockSize(next);
+    if (size - blockSz >= MIN_BLOCK_SIZE) {
+        block->size_status = blockSz + bits;
+        blockHeader *tail = nextBlock(block);
+        tail->size_status = (size - blockSz) + P_BIT;
+        attachFree(arena, tail);
+    } else {
+        block->size_status = size + bits;
+        setPrevAllocated(nextBlock(block), 1);
+    }
+    return 0;
+}
+
+/*
+ * Returns the first payload address in a free block that is a multiple of
+ * align and leaves either no gap or room for a free block in front of it.
+ */
+static inline uintptr_t alignedPayload(blockHeader *block, size_t align) {
+    uintptr_t payload = (uintptr_t)(block + 1);
+    if (payload % align == 0) {
+        return payload;
+    }
+    return (payload + MIN_BLOCK_SIZE + align - 1) & ~(uintptr_t)(align - 1);
+}
+
+/*
+ * Returns whether a free block holds a block of blockSz bytes whose
+ * payload is a multiple of align.
+ */
+static inline int fitsAligned(blockHeader *block, size_t blockSz,
+        size_t align) {
+    return alignedPayload(block, align) - sizeof(blockHeader) + blockSz <= 
+            (uintptr_t)nextBlock(block);
+}
+
+/*
+ * The placement policy for aligned requests: the first free block that
+ * holds an aligned block of blockSz bytes, searching the lists from the
+ * request's own bin up, then the best-fit tree and then the wilderness.
+ * A block that is smaller than blockSz + align can still fit if its
+ * payload happens to fall close to a multiple of align.
+ */
+static blockHeader *alignedFit(heapArena *arena, size_t blockSz,
+        size_t align) {
+    blockHeader *block;
+    int idx = nextNonEmptyBin(arena, binIndex(blockSz));
+    for (; idx >= 0; idx = nextNonEmptyBin(arena, idx + 1)) {
+        for (block = arena->bins[idx]; block; block = linksOf(block)->next) {
+            if (fitsAligned(block, blockSz, align)) {
+                return block;
+            }
+        }
+    }
+    for (block = treeFit(arena, blockSz); block; block = treeNext(block)) {
+        if (fitsAligned(block, blockSz, align)) {
+            return block;
+        }
+    }
+    block = arena->wilderness;
+    return block != NULL && fitsAligned(block, blockSz, align) ? block : NULL;
+}
+
+/*
+ * Allocates a block of blockSz bytes with its payload a multiple of align
+ * from the arena. The free block alignedFit picks is split three ways:
+ * the gap in front of the aligned block and the tail after it stay free.
+ * Neither needs coalescing since a free block's neighbors are allocated.
+ * Falls back to consolidating the quick lists and then to growing the
+ * arena by enough to hold an aligned block anywhere.
+ * Callers in thread-safe mode must hold the arena's lock.
+ * Returns the header of the aligned block or NULL if nothing fits.
+ */
+static blockHeader *allocAlignedBlock(heapArena *arena, size_t blockSz,
+        size_t align) {
+    blockHeader *freeBlock = alignedFit(arena, blockSz, align);
+    if (freeBlock == NULL && arena->quickBytes != 0) {
+        consolidateQuick(arena);
+        freeBlock = alignedFit(arena, blockSz, align);
+    }
+    if (freeBlock == NULL) {
+        if (growArena(arena, blockSz + align + MIN_BLOCK_SIZE) != 0) {
+            return NULL;
+        }
+        freeBlock = arena->wilderness;
+    }
+    detachFree(arena, freeBlock);
+
+    //headers are written front to back so that attachFree always finds
+    //a valid block after the one it is given
+    blockHeader *block = (blockHeader*)alignedPayload(freeBlock, align) - 1;
+    blockHeader *next = nextBlock(freeBlock);
+    size_t gap = (char*)block - (char*)freeBlock;
+    size_t size = (char*)next - (char*)block;
+    size_t prevBit = freeBlock->size_status & P_BIT;
+    if (size - blockSz >= MIN_BLOCK_SIZE) {
+        blockHeader *tail = (blockHeader*)((char*)block + blockSz);
+        tail->size_status = (size - blockSz) + P_BIT;
+        attachFree(arena, tail);
+        size = blockSz;
+    } else {
+        setPrevAllocated(next, 1);
+    }
+    block->size_status = size + A_BIT + (gap == 0 ? prevBit : 0);
+    if (gap != 0) {
+        freeBlock->size_status = gap + prevBit;
+        attachFree(arena, freeBlock);
+    }
+    return block;
+}
+
+/*
+ * Function for allocating a block with an aligned payload.
+ * Argument size: requested size for the payload.
+ * Argument align: the payload's address is a multiple of this, which
+ * must be a power of two.
+ * Returns the address of the allocated block, which freeHeap and
+ * reallocHeap accept like any other, or NULL on failure.
+ * Only the gap in front of the payload needed to reach the alignment is
+ * split off, as a free block, so nothing is allocated beyond size.
+ * Requests of at least HEAP_OPT_MMAP_THRESHOLD bytes get a mapping of
+ * their own that starts at most a page in front of the payload.
+ */
+void* allocHeapAligned(size_t size, size_t align) {
+    if (align == 0 || (align & (align - 1)) != 0) {
+        return NULL;
+    }
+    if (align <= ALIGNMENT) {
+        return allocHeap(size);
+    }
+    if (size == 0 || align > MAX_REQUEST || 
+            size > MAX_REQUEST - align - MIN_BLOCK_SIZE) {
+        return NULL;
+    }
+    if (mmapThreshold != 0 && size >= mmapThreshold) {
+        return allocDirect(size, align);
+    }
+    if (growSize == 0 && size > allocsize) {
+        return NULL;
+    }
+
+    if (buddyEngine) {
+        return allocFromBuddies(size, align);
+    }
+
+    size_t blockSz = blockSizeFor(size);
+    heapArena *home = pickArena();
+    heapArena *arena = home;
+    do {
+        lockArena(arena);
+        blockHeader *block = allocAlignedBlock(arena, blockSz, align);
+        unlockArena(arena);
+        if (block != NULL) {
+            return block + 1;
+        }
+        if (++arena == arenas + numArenas) {
+            arena = arenas;
+        }
+    } while (arena != home);
+    return NULL;
+}
+
+/*
+ * Function for resizing a previously allocated block.
+ * Argument ptr: address of the block to be resized, NULL to allocate.
+ * Argument size: requested size for the payload, 0 to free.
+ * Returns the address of the resized block, which keeps the old contents
+ * up to the smaller of the two sizes. This is ptr itself when the block
+ * could be shrunk or grown into the free block after it.
+ * Returns NULL on failure, in which case the old block is left untouched.
+ * Blocks with a mapping of their own are resized with mremap, slab
+ * objects stay where they are as long as the new size fits.
+ */
+void* reallocHeap(void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return allocHeap(size);
+    }
+    if (size == 0) {
+        freeHeap(ptr);
+        return NULL;
+    }
+    if ((uintptr_t)ptr % ALIGNMENT != 0 || size > MAX_REQUEST) {
+        return NULL;
+    }
+
+    blockHeader *header = (blockHeader*)ptr - 1;
+    heapArena *arena = ownerArena(ptr);
+    size_t oldSize;
+    slabHeader *slab;
+    if (arena == NULL && (slab = slabOf(ptr)) != NULL) {
+        if (slabIndex(slab, ptr) < 0) {
+            return NULL;
+        }
+        if (size <= slab->objSize) {
+            return ptr;
+        }
+        oldSize = slab->objSize;
+    } else if (arena == NULL) {
+        header = directHeader(ptr);
+        if (header == NULL) {
+            return NULL;
+        }
+        //stay in a mapping unless the block became small enough for
+        //the arenas
+        if (mmapThreshold == 0 || size >= mmapThreshold) {
+            return reallocDirect(header, size);
+        }
+        oldSize = blockSize(header) - directOffset(ptr);
+    } else if (buddyEngine) {
+        //keep the block while the new size needs the same order
+        lockArena(arena);
+        int order = buddyOrderAt(&arena->buddy, (char*)ptr - arena->buddy.base);
+        int allocated = order >= 0 && !testBit(arena->buddy.freeBits[order], 
+                buddyBit((char*)ptr - arena->buddy.base, order));
+        unlockArena(arena);
+        if (!allocated) {
+            return NULL;
+        }
+        if (buddyOrderFor(size) == order) {
+            return ptr;
+        }
+        oldSize = buddySize(order);
+    } else {
+        if ((header->size_status & A_BIT) == 0) {
+            return NULL;
+        }
+        lockArena(arena);
+        int resized = resizeBlock(arena, header, blockSizeFor(size));
+        unlockArena(arena);
+        if (resized == 0) {
+            return ptr;
+        }
+        oldSize = blockSize(header) - sizeof(blockHeader);
+    }
+
+    //no way around moving it
+    void *moved = allocHeap(size);
+    if (moved == NULL) {
+        return NULL;
+    }
+    memcpy(moved, ptr, oldSize < size ? oldSize : size);
+    freeHeap(ptr);
+    return moved;
+}
+
+/*
+ * Function for returning unused memory to the operating system.
+ * Consolidates the quick lists and remote free queues, then releases the
+ * whole pages inside every free block that spans at least one page,
+ * keeping only block headers, footers and free list links.
+ * Returns the number of bytes released.
+ */
+size_t heapTrim() {
+    size_t released = 0;
+    int i;
+    for (i = 0; i < numArenas; i++) {
+        lockArena(&arenas[i]);
+        drainRemote(&arenas[i]);
+        consolidateQuick(&arenas[i]);
+        released += trimArena(&arenas[i]);
+        unlockArena(&arenas[i]);
+    }
+    return released;
+}
+
+/*
+ * Function for creating a bump arena.
+ * Argument chunkSize: bytes to take from the heap at a time, 0 for
+ * the default of 64 KiB.
+ * Returns the new arena, which holds no memory until its first
+ * arenaAlloc, or NULL if it cannot be allocated.
+ * A bump arena is not thread safe, even in thread-safe mode.
+ */
+arena_t* arenaCreate(size_t chunkSize) {
+    if (chunkSize > MAX_REQUEST) {
+        return NULL;
+    }
+    arena_t *arena = allocHeap(sizeof(arena_t));
+    if (arena == NULL) {
+        return NULL;
+    }
+    arena->chunks = NULL;
+    arena->current = NULL;
+    arena->next = NULL;
+    arena->end = NULL;
+    arena->chunkSize = chunkSize != 0 ? chunkSize : BUMP_CHUNK_SIZE;
+    return arena;
+}
+
+/*
+ * Function for allocating from a bump arena.
+ * Argument arena: arena returned by arenaCreate.
+ * Argument size: requested size for the payload.
+ * Returns the address of size bytes aligned like allocHeap's, or NULL if
+ * size is 0 or the heap cannot supply another chunk.
+ * The payload lives until the next arenaReset or arenaDestroy and must
+ * not be passed to freeHeap.
+ */
+void* arenaAlloc(arena_t *arena, size_t size) {
+    if (size == 0 || size > MAX_REQUEST) {
+        return NULL;
+    }
+    size = ALIGN_UP(size);
+    if (size <= (size_t)(arena->end - arena->next)) {
+        void *ptr = arena->next;
+        arena->next += size;
+        return ptr;
+    }
+
+    //move on to the first chunk kept from before a reset that is big
+    //enough, the ones skipped stay unused until the next reset
+    bumpChunk *chunk = arena->current != NULL ? 
+            arena->current->next : arena->chunks;
+    while (chunk != NULL && chunk->size < size) {
+        chunk = chunk->next;
+    }
+    if (chunk == NULL) {
+        size_t chunkSize = size > arena->chunkSize ? size : arena->chunkSize;
+        chunk = allocHeap(BUMP_HEADER + chunkSize);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        chunk->size = chunkSize;
+        if (arena->current != NULL) {
+            chunk->next = arena->current->next;
+            arena->current->next = chunk;
+        } else {
+            chunk->next = arena->chunks;
+            arena->chunks = chunk;
+        }
+    }
+    arena->current = chunk;
+    arena->next = (char*)chunk + BUMP_HEADER + size;
+    arena->end = (char*)chunk + BUMP_HEADER + chunk->size;
+    return (char*)chunk + BUMP_HEADER;
+}
+
+/*
+ * Function for freeing everything allocated from a bump arena at once.
+ * Argument arena: arena returned by arenaCreate.
+ * The arena keeps its chunks and starts over at the first one, so this
+ * takes constant time however much was allocated.
+ */
+void arenaReset(arena_t *arena) {
+    arena->current = NULL;
+    arena->next = NULL;
+    arena->end = NULL;
+}
+
+/*
+ * Function for destroying a bump arena.
+ * Argument arena: arena returned by arenaCreate, or NULL.
+ * Gives all of the arena's chunks back to the heap.
+ */
+void arenaDestroy(arena_t *arena) {
+    if (arena == NULL) {
+        return;
+    }
+    bumpChunk *chunk = arena->chunks;
+    while (chunk != NULL) {
+        bumpChunk *next = chunk->next;
+        freeHeap(chunk);
+        chunk = next;
+    }
+    freeHeap(arena);
+}
+
+/*
+ * Lays out an empty heap_t over a fresh, zeroed mapping of len bytes,
+ * with attr for its lock.
+ */
+static void initHandle(heap_t *heap, size_t len,
+        const pthread_mutexattr_t *attr) {
+    heap->mapped = len;
+    heap->arena.fixed = 1;
+    heap->arena.useSizeTree = useSizeTree;
+    pthread_mutex_init(&heap->arena.lock, attr);
+    initSegment(&heap->arena, &heap->arena.first, 
+            (blockHeader*)((char*)heap + HANDLE_HEADER),
+            len - HANDLE_HEADER - sizeof(blockHeader));
+}
+
+/*
+ * Function for creating a heap of its own.
+ * Argument size: the size of the heap space, rounded up to whole pages.
+ * Returns the new heap or NULL if it cannot be mapped.
+ * The heap is isolated from the one initHeap sets up and from every other
+ * heap_t, and it does not need initHeap to have been called. It follows
+ * the placement policy, quick list and trim options but never grows, and
+ * has no slabs, thread caches or direct mappings. In thread-safe mode it
+ * has a lock of its own.
+ */
+heap_t* heapCreate(size_t size) {
+    if (size == 0 || size > MAX_REQUEST) {
+        return NULL;
+    }
+    pageSize = getpagesize();
+    size_t unit = hugePages != HEAP_HUGE_NONE ? HUGE_SIZE : pageSize;
+    if (trimGranule == 0) {
+        trimGranule = unit;
+    }
+    size_t len = HANDLE_HEADER + size + sizeof(blockHeader);
+    len = (len + unit - 1) & ~(unit - 1);
+
+    char *base;
+    if (hugePages != HEAP_HUGE_NONE) {
+        base = mapHuge(len);
+        if (base == NULL) {
+            return NULL;
+        }
+    } else {
+        base = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (MAP_FAILED == base) {
+            return NULL;
+        }
+    }
+
+    heap_t *heap = (heap_t*)base;
+    initHandle(heap, len, NULL);
+    heap->fd = -1;
+    return heap;
+}
+
+/*
+ * Function for allocating from a heap of heapCreate.
+ * Argument heap: heap returned by heapCreate.
+ * Argument size: requested size for the payload.
+ * Returns the address of the allocated block or NULL on failure.
+ */
+void* heapAllocFrom(heap_t *heap, size_t size) {
+    if (size == 0 || size > MAX_REQUEST) {
+        return NULL;
+    }
+    lockArena(&heap->arena);
+    blockHeader *block = allocBlock(&heap->arena, blockSizeFor(size));
+    unlockArena(&heap->arena);
+    return block == NULL ? NULL : (void*)(block + 1);
+}
+
+/*
+ * Function for freeing a block of a heap of heapCreate.
+ * Argument heap: heap the block was allocated from.
+ * Argument ptr: address of the block to be freed up.
+ * Returns 0 on success.
+ * Returns -1 for the same reasons as freeHeap, or if ptr does not lie in
+ * heap.
+ */
+int heapFreeTo(heap_t *heap, void *ptr) {
+    heapSegment *segment = &heap->arena.first;
+    if (ptr == NULL || (uintptr_t)ptr % ALIGNMENT != 0 ||
+            (blockHeader*)ptr <= segment->start ||
+            (char*)ptr >= (char*)segment->start + segment->size) {
+        return -1;
+    }
+    blockHeader *block = (blockHeader*)ptr - 1;
+    lockArena(&heap->arena);
+    int ret = (block->size_status & A_BIT) == 0 ? -1 : 
+            quickFree(&heap->arena, block);
+    unlockArena(&heap->arena);
+    return ret;
+}
+
+/*
+ * Function for destroying a heap of heapCreate.
+ * Argument heap: heap returned by heapCreate, or NULL. A heap of heapOpen
+ * is closed with heapClose instead.
+ * Frees every block of the heap at once with a single munmap.
+ */
+void heapDestroy(heap_t *heap) {
+    if (heap == NULL) {
+        return;
+    }
+    pthread_mutex_destroy(&heap->arena.lock);
+    munmap(heap, heap->mapped);
+}
+
+/*
+ * Rebuilds the free lists of a heap file that was mapped somewhere else,
+ * or built them for another placement policy, from its boundary tags.
+ * The arena's own pointers are reset to the new mapping first.
+ */
+static void rebuildHandle(heap_t *heap) {
+    heapArena *arena = &heap->arena;
+    memset(arena->bins, 0, sizeof(arena->bins));
+    memset(arena->binmap, 0, sizeof(arena->binmap));
+    arena->binmapWords = 0;
+    arena->sizeTree = NULL;
+    arena->useSizeTree = useSizeTree;
+    arena->rover = NULL;
+    arena->wilderness = NULL;
+    arena->first.arena = arena;
+    arena->first.start = (blockHeader*)((char*)heap + HANDLE_HEADER);
+
+    blockHeader *block = arena->first.start;
+    for (; blockSize(block) != 0; block = nextBlock(block)) {
+        if ((block->size_status & A_BIT) == 0) {
+            attachFree(arena, block);
+        }
+    }
+}
+
+/*
+ * Function for opening a heap kept in a file.
+ * Argument path: the heap file, created if it does not exist yet.
+ * Argument size: the size of the heap space of a new file, rounded up to
+ * whole pages. Ignored when the file already holds a heap.
+ * Returns the heap, with every block allocated before the last heapClose
+ * still in place, or NULL on failure. That includes files that hold no
+ * heap, were written by an incompatible build, were not closed cleanly
+ * or are open in another process already.
+ * The file is mapped MAP_SHARED, at the address it had last time if that
+ * is still free, in which case opening it touches nothing but the
+ * superblock. Otherwise its free lists are rebuilt from the block chain.
+ * Pointers kept inside the heap should be stored as heapOffsetOf offsets
+ * so that they survive a move, starting from heapGetRoot.
+ */
+heap_t* heapOpen(const char *path, size_t size) {
+    pageSize = getpagesize();
+    if (trimGranule == 0) {
+        trimGranule = pageSize;
+    }
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (-1 == fd) {
+        return NULL;
+    }
+    //one process at a time, the lock goes away with the descriptor
+    struct stat st;
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0 || fstat(fd, &st) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    heap_t header;
+    char *hint = NULL;
+    size_t len;
+    if (st.st_size == 0) {
+        if (size == 0 || size > MAX_REQUEST) {
+            close(fd);
+            return NULL;
+        }
+        len = HANDLE_HEADER + size + sizeof(blockHeader);
+        len = (len + pageSize - 1) & ~(pageSize - 1);
+        if (ftruncate(fd, len) != 0) {
+            close(fd);
+            return NULL;
+        }
+    } else {
+        if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+                header.magic != HEAP_MAGIC || 
+                header.handleSize != sizeof(heap_t) ||
+                header.mapped != (size_t)st.st_size || !header.clean) {
+            close(fd);
+            return NULL;
+        }
+        len = header.mapped;
+        hint = header.base;
+    }
+    char *base = mmap(hint, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == base) {
+        close(fd);
+        return NULL;
+    }
+
+    heap_t *heap = (heap_t*)base;
+    if (hint == NULL) {
+        initHandle(heap, len, NULL);
+        heap->magic = HEAP_MAGIC;
+        heap->handleSize = sizeof(heap_t);
+    } else {
+        pthread_mutex_init(&heap->arena.lock, NULL);
+        if (base != hint || heap->arena.useSizeTree != useSizeTree) {
+            rebuildHandle(heap);
+        }
+    }
+    heap->arena.shared = 1;
+    heap->base = base;
+    heap->fd = fd;
 
-/* Size of heap allocation padded to round to nearest page size.
+    //a crash from here on leaves the file marked as not closed
+    heap->clean = 0;
+    msync(base, pageSize, MS_SYNC);
+    return heap;
+}
+
+/*
+ * Function for closing a heap of heapOpen.
+ * Argument heap: heap returned by heapOpen, or NULL.
+ * Writes the heap back to its file and unmaps it.
+ * Returns 0 on success.
+ * Returns -1 if the heap could not be written back, in which case the
+ * file is not marked as closed cleanly.
  */
-int allocsize;
+int heapClose(heap_t *heap) {
+    if (heap == NULL) {
+        return 0;
+    }
+    int fd = heap->fd;
+    size_t len = heap->mapped;
+    int ret = msync(heap, len, MS_SYNC);
+    if (ret == 0) {
+        heap->clean = 1;
+        ret = msync(heap, pageSize, MS_SYNC);
+    }
+    pthread_mutex_destroy(&heap->arena.lock);
+    munmap(heap, len);
+    close(fd);
+    return ret == 0 ? 0 : -1;
+}
 
 /*
- * Additional global variables may be added as needed below
+ * Lays out a new shared heap over the shared memory object fd.
+ * The magic goes in last, once the heap is ready for other processes.
  */
-blockHeader *lastAllocMade = NULL;
- 
-/* 
- * Function for allocating 'size' bytes of heap memory.
- * Argument size: requested size for the payload
- * Returns address of allocated block on success.
- * Returns NULL on failure.
- * This function should:
- * - Check size - Return NULL if not positive or if larger than heap space.
- * - Determine block size rounding up to a multiple of 8 and possibly adding padding as a result.
- * - Use NEXT-FIT PLACEMENT POLICY to chose a free block
- * - Use SPLITTING to divide the chosen free block into two if it is too large.
- * - Update header(s) and footer as needed.
- * Tips: Be careful with pointer arithmetic and scale factors.
+static heap_t* createShared(int fd, size_t size) {
+    if (size == 0 || size > MAX_REQUEST) {
+        return NULL;
+    }
+    size_t len = HANDLE_HEADER + size + sizeof(blockHeader);
+    len = (len + pageSize - 1) & ~(pageSize - 1);
+    if (ftruncate(fd, len) != 0) {
+        return NULL;
+    }
+    char *base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == base) {
+        return NULL;
+    }
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    heap_t *heap = (heap_t*)base;
+    initHandle(heap, len, &attr);
+    pthread_mutexattr_destroy(&attr);
+    heap->arena.shared = 1;
+    heap->arena.processShared = 1;
+    heap->handleSize = sizeof(heap_t);
+    heap->base = base;
+    heap->fd = -1;
+    __atomic_store_n(&heap->magic, HEAP_MAGIC, __ATOMIC_RELEASE);
+    return heap;
+}
+
+/*
+ * Maps the shared heap in the shared memory object fd at its creator's
+ * address, waiting for the creator to finish laying it out.
  */
-void* allocHeap(int size) {     
-    //TODO: Your code goes in here.
-    //if size is a negative number return null
-    if (size < 0) {
+static heap_t* attachShared(int fd) {
+    size_t headLen = (sizeof(heap_t) + pageSize - 1) & ~(pageSize - 1);
+    heap_t *head = MAP_FAILED;
+    struct stat st;
+    int tries;
+    for (tries = 0; ; tries++) {
+        //touching the object before the creator sizes it raises SIGBUS
+        if (MAP_FAILED == head && fstat(fd, &st) == 0 &&
+                (size_t)st.st_size >= headLen) {
+            head = mmap(NULL, headLen, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        if (head != MAP_FAILED && 
+                __atomic_load_n(&head->magic, __ATOMIC_ACQUIRE) == HEAP_MAGIC) {
+            break;
+        }
+        if (tries == SHARE_TRIES) {
+            if (head != MAP_FAILED) {
+                munmap(head, headLen);
+            }
+            return NULL;
+        }
+        usleep(1000);
+    }
+    char *hint = head->base;
+    size_t len = head->mapped;
+    int usable = head->handleSize == sizeof(heap_t);
+    munmap(head, headLen);
+    if (!usable) {
         return NULL;
     }
-    //if the size is larger than allecated space return null
-    if (size > allocsize) {
+
+#ifdef MAP_FIXED_NOREPLACE
+    int flags = MAP_SHARED | MAP_FIXED_NOREPLACE;
+#else
+    int flags = MAP_SHARED;
+#endif
+    char *base = mmap(hint, len, PROT_READ | PROT_WRITE, flags, fd, 0);
+    if (base != hint) {
+        //older kernels take the address as a hint only
+        if (base != MAP_FAILED) {
+            munmap(base, len);
+        }
         return NULL;
     }
-    if (lastAllocMade == NULL) {
-	lastAllocMade = heapStart;
+    return (heap_t*)base;
+}
+
+/*
+ * Function for creating or attaching to a heap in shared memory.
+ * Argument name: name of the POSIX shared memory object, like "/queue".
+ * Argument size: the size of the heap space of a new object, rounded up
+ * to whole pages. Ignored when the object already exists.
+ * Returns the heap or NULL on failure. That includes objects that hold no
+ * heap, were created by an incompatible build, and heaps whose address is
+ * taken in this process already.
+ * Every process maps the heap at the same address, so a block allocated
+ * with heapAllocFrom in one process can be read and given to heapFreeTo
+ * in another without copying. Pass blocks between processes as
+ * heapOffsetOf offsets. The heap is always locked, with a robust mutex
+ * that the next process takes over if its owner dies. Like a heap of
+ * heapOpen it never grows, is never trimmed and parks nothing on quick
+ * lists. Each process lets go of it with heapDetach, and the object
+ * lives on until shm_unlink removes its name and the last one does.
+ */
+heap_t* heapShare(const char *name, size_t size) {
+    pageSize = getpagesize();
+    if (trimGranule == 0) {
+        trimGranule = pageSize;
+    }
+    heap_t *heap = NULL;
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd != -1) {
+        heap = createShared(fd, size);
+        if (heap == NULL) {
+            //nobody could attach to what is left of it
+            shm_unlink(name);
+        }
+    } else if (EEXIST == errno) {
+        fd = shm_open(name, O_RDWR, 0);
+        if (fd != -1) {
+            heap = attachShared(fd);
+        }
     }
-    //gets the pointer for the last block possible
-    blockHeader *memoryEnd =(void*)heapStart + allocsize;
-    
-   
-    //Makes sure the block is correctly sized to multiple of 8
-    int remainder = size % 8;
-    int padding = 8 - remainder;
-    int paddedSize = size;
-    if (remainder != 0) {
-        paddedSize = size + padding;
+    //the mapping keeps the object alive without the descriptor
+    if (fd != -1) {
+        close(fd);
     }
-    
-    //while you can't find a free block keep going through the blocks looking 
-    //at headers till you
-    //find a free block you can use that also large enough to fit everything
-    blockHeader *currentAllocatedBlock = lastAllocMade;
-    // while the current block is filled or to small, look for next block 
-    int counter = 0;
-    while( ( (currentAllocatedBlock->size_status & 1) != 0 ) || 
-		    ( (currentAllocatedBlock->size_status/8)*8 < paddedSize ) ){
-    	
-	//if we have already been through the heap twice return null	
- 	if( counter > 2) {
-		return NULL;
-	}
-
-	int takenSize = currentAllocatedBlock->size_status / 8;
-        takenSize = takenSize * 8;
-
-        currentAllocatedBlock = (blockHeader*)((void*)currentAllocatedBlock + takenSize);
-	//checks to see if we have been through the space if we have change counter 
-	//and go back to beginning
-        if (( (void*)currentAllocatedBlock + takenSize) > (void*)memoryEnd) {
-
-           currentAllocatedBlock = NULL;
-	   counter++;
-	   currentAllocatedBlock = heapStart;
-        }
-    }
-
-    //the block that gets past the last while look will aways be free and large
-    //enough to allocate in memeory 
-    blockHeader *freeBlock = currentAllocatedBlock;
-
-    //Here we check one more time that it is in fact free but it
-    //should always be the case
-    if ( (freeBlock->size_status & 1) == 0 ) {
-	//gets the total p bit of the free block
-        int freeSize = freeBlock->size_status / 8;
-        freeSize = freeSize * 8;
-	blockHeader *nextBlockHeader = (void*)freeBlock + (paddedSize);
-	//if the next block is free we need to split the current space into a free 
-	//block and filled block
-	if( ( nextBlockHeader->size_status & 1) == 0) {
-            //create and change footer first of the newly created free block
-            blockHeader *footer = (blockHeader*) ((void*)freeBlock + freeSize - 4);
-
-	    //give the footer the correct size, its a bits will be /zerozero
-            footer->size_status = freeSize - paddedSize;
-            //check if block behind me is allocate	
-            blockHeader *newFreeHeader = ((void*)freeBlock + paddedSize);
-            //changes the p bit of the new free header
-            newFreeHeader->size_status = freeBlock->size_status - paddedSize;
-        }
-
-	//if the next block is taken we just need to change the a bits of the next block
-        if( ( nextBlockHeader->size_status & 1) == 1) {
-
-	    nextBlockHeader->size_status = ((nextBlockHeader->size_status/8)*8) + 3;
-
-	}
-	
-        //change the header so save off this block
-        freeBlock->size_status = paddedSize + 3;
-	
-	//update the last allocmade to be the one you are currently making
-        lastAllocMade = freeBlock;
-        return ((void*)freeBlock) + 4;
+    return heap;
+}
+
+/*
+ * Function for detaching from a heap of heapShare.
+ * Argument heap: heap returned by heapShare, or NULL.
+ * Unmaps the heap from the calling process only. Blocks it allocated
+ * stay allocated for the other processes.
+ */
+void heapDetach(heap_t *heap) {
+    if (heap == NULL) {
+        return;
     }
+    munmap(heap, heap->mapped);
+}
 
-    return NULL;
-} 
- 
-/* 
- * Function for freeing up a previously allocated block.
- * Argument ptr: address of the block to be freed up.
+/*
+ * Function for turning a pointer into a heap into an offset that stays
+ * valid wherever the heap is mapped.
+ * Argument heap: the heap ptr lies in.
+ * Argument ptr: the pointer, or NULL.
+ * Returns the offset of ptr from the start of the heap, 0 for NULL.
+ */
+size_t heapOffsetOf(heap_t *heap, void *ptr) {
+    return ptr == NULL ? 0 : (size_t)((char*)ptr - (char*)heap);
+}
+
+/*
+ * Function for turning an offset from heapOffsetOf back into a pointer.
+ * Argument heap: the heap the offset was taken in.
+ * Argument offset: the offset, or 0.
+ * Returns the pointer at that offset in the heap as it is mapped now,
+ * NULL for 0.
+ */
+void* heapPointerAt(heap_t *heap, size_t offset) {
+    return offset == 0 ? NULL : (char*)heap + offset;
+}
+
+/*
+ * Function for setting the root block of a heap, the one a program finds
+ * its data from when it opens the heap again.
+ * Argument heap: the heap.
+ * Argument ptr: a block of the heap, or NULL.
+ */
+void heapSetRoot(heap_t *heap, void *ptr) {
+    heap->root = heapOffsetOf(heap, ptr);
+}
+
+/*
+ * Function for getting the root block of a heap.
+ * Argument heap: the heap.
+ * Returns the block last given to heapSetRoot, or NULL.
+ */
+void* heapGetRoot(heap_t *heap) {
+    return heapPointerAt(heap, heap->root);
+}
+
+/*
+ * Function for setting an allocator option.
+ * Argument option: one of the HEAP_OPT_ constants in heapAlloc.h.
+ * Argument value: the new value for that option.
  * Returns 0 on success.
- * Returns -1 on failure.
- * This function should:
- * - Return -1 if ptr is NULL.
- * - Return -1 if ptr is not a multiple of 8.
- * - Return -1 if ptr is outside of the heap space.
- * - Return -1 if ptr block is already freed.
- * - USE IMMEDIATE COALESCING if one or both of the adjacent neighbors are free.
- * - Update header(s) and footer as needed.
- */                    
-int freeHeap(void *ptr) {    
-    //makes sure the pointer to be freed is not null
-    if (ptr == NULL) {
-	return -1;
+ * Returns -1 if the option is unknown, the value is out of range or the
+ * option can no longer be changed.
+ */
+int heapSetOption(int option, long value) {
+    switch (option) {
+    case HEAP_OPT_TRIM_THRESHOLD:
+        if (value < 0) {
+            return -1;
+        }
+        trimThreshold = value;
+        return 0;
+    case HEAP_OPT_MMAP_THRESHOLD:
+        if (value < 0) {
+            return -1;
+        }
+        mmapThreshold = value;
+        return 0;
+    case HEAP_OPT_SLAB_LIMIT:
+        if (value < 0 || value > SLAB_MAX) {
+            return -1;
+        }
+        slabLimit = value;
+        return 0;
+    case HEAP_OPT_QUICK_BUDGET:
+        if (value < 0) {
+            return -1;
+        }
+        quickBudget = value;
+        return 0;
+    case HEAP_OPT_TRIM_LAZY:
+#ifdef MADV_FREE
+        trimAdvice = value ? MADV_FREE : MADV_DONTNEED;
+#endif
+        return 0;
     }
-    //make sure the pointer to be freed is aligned
-    if ((int)ptr % 8 != 0) {
+
+    //the remaining options shape the heap and are fixed once it exists
+    if (heapStart != NULL) {
         return -1;
     }
-    //makes sure the pointer is insdie the memory range
-    if ((void*)ptr < (void*)heapStart) { //maybe heapstart +4
+    switch (option) {
+    case HEAP_OPT_THREAD_SAFE:
+        threadSafe = value != 0;
+        return 0;
+    case HEAP_OPT_ARENAS:
+        if (value < 1 || value > MAX_ARENAS) {
+            return -1;
+        }
+        numArenas = value;
+        return 0;
+    case HEAP_OPT_ARENA_BY_CPU:
+        arenaByCpu = value != 0;
+        return 0;
+    case HEAP_OPT_CPU_CACHE:
+        cpuCacheWanted = value != 0;
+        return 0;
+    case HEAP_OPT_GROW_SIZE:
+        if (value < 0 || (unsigned long)value > MAX_REQUEST) {
+            return -1;
+        }
+        growSize = value;
+        return 0;
+    case HEAP_OPT_HUGE_PAGES:
+        if (value != HEAP_HUGE_NONE && value != HEAP_HUGE_TRANSPARENT &&
+                value != HEAP_HUGE_TLB) {
+            return -1;
+        }
+        hugePages = value;
+        return 0;
+    case HEAP_OPT_ENGINE:
+        if (value != HEAP_ENGINE_BLOCKS && value != HEAP_ENGINE_BUDDY) {
+            return -1;
+        }
+        buddyEngine = value == HEAP_ENGINE_BUDDY;
+        return 0;
+    case HEAP_OPT_POLICY:
+        if (value < 0 || (unsigned long)value >= 
+                sizeof(fitPolicies) / sizeof(fitPolicies[0])) {
+            return -1;
+        }
+        findFit = fitPolicies[value];
+        useSizeTree = value == HEAP_POLICY_BEST_FIT;
+        return 0;
+    default:
         return -1;
     }
+}
+ 
+/*
+ * Lays out an empty arena over allocsize + ALIGNMENT bytes starting at base.
+ */
+static void initArena(heapArena *arena, char *base) {
+    pthread_mutex_init(&arena->lock, NULL);
+    arena->useSizeTree = useSizeTree;
 
-    //gets the pointer for the last block possible
-    blockHeader *memoryEnd =(void*)heapStart + allocsize;
-    //makes sure the pointer is insdie the memory range
-    if ((void*)ptr > (void*)memoryEnd) {
-        return -1;
+    // The buddy engine's pool starts right at base, its first segment only
+    // records where the pool lies
+    if (buddyEngine) {
+        initBuddyPool(&arena->buddy, base, allocsize + ALIGNMENT);
+        arena->first.arena = arena;
+        arena->first.start = (blockHeader*)base;
+        arena->first.size = arena->buddy.size;
+        return;
     }
 
-    //gets the block header of the ptr that is to be freed
-    blockHeader *freeBlockHeader = (void*)ptr - 4;
+    // Initially there is only one big free block in the arena.
+    // Skip the first header's worth of bytes for double word alignment.
+    initSegment(arena, &arena->first, (blockHeader*) base + 1, allocsize);
+}
 
-    //pointer to be freed is already freeded return zero
-    if ( ( freeBlockHeader->size_status & 1) == 0) {
-	return -1;
-    }
-    
-    int sizeOfNewFreeBlock = (freeBlockHeader->size_status / 8 ) * 8;
-
-    blockHeader *nextBlockHeader = (void*)ptr + sizeOfNewFreeBlock - 4 ;
-
-    //if the next block and previous block is already taken 
-    //then fill the blick and update the footer   
-    if ( ( ( ( nextBlockHeader->size_status%8 ) % 2) == 1) &&
-		    ( (freeBlockHeader->size_status % 8) >= 2) ) {
-	//creats next block footer
-    	blockHeader *newFreeBlockFooter = (void*)ptr + sizeOfNewFreeBlock - 8;
-	//upddates the new block size
-    	newFreeBlockFooter->size_status = sizeOfNewFreeBlock;
-	//update next block header
-	nextBlockHeader->size_status = nextBlockHeader->size_status - 2 ;
-	//update the new free blocks a bit
-	freeBlockHeader->size_status = freeBlockHeader->size_status -1; 
-    }
-    //keeps track of if a coalsce has already happened
-    int hasBeenCoalescedBack = 0;
-
-    //if the next block is free you need to coalecse backwards
-    if ( ( ( nextBlockHeader->size_status % 8) % 2 ) == 0) {
-
-	//gets the next blocks footer which will be the new combined footer	
-	blockHeader *nextBlockFooter = (void*)nextBlockHeader + 
-		((nextBlockHeader->size_status/8)*8) - 4;
-	//updates the value of the footer for the new combined block	
-	nextBlockFooter->size_status = nextBlockFooter->size_status + sizeOfNewFreeBlock ; 
-	//changes the freeblockHeader to have the correct a bit for its own status
-	freeBlockHeader->size_status = (nextBlockFooter->size_status/8)*8 + 
-		(freeBlockHeader->size_status % 8) - 1; 
-	
-	hasBeenCoalescedBack++;
-    }
-    //I had to move some times two a second line as my code 
-    //ran past teh 80 widdth limit sorry if it is less readible
-    //if the previous block is free you need to coalecse forwards 
-    if ((freeBlockHeader->size_status % 8) < 2) {
-	//change the next block header so its previous bit is zero or freed
-	blockHeader *nextHeader = (void*)freeBlockHeader + 
-		(freeBlockHeader->size_status/8)*8;
-        //if the next block is already filled change the a bits so it relfects the alst free
-	if ( (nextHeader->size_status & 1) == 1) {
-	    nextHeader->size_status = ((nextHeader->size_status/8)*8) + 1;
-	}
-	//gets the previous footer to get to prevous head
-	blockHeader *previousFooter = (void*)freeBlockHeader - 4;
-        //gets previous head so coalesce the two blocks
-	blockHeader *previousHeader = (void*)previousFooter - 
-		previousFooter->size_status + 4;
-        //updates the previous heads size status
-	previousHeader->size_status = previousHeader->size_status + 
-		((freeBlockHeader->size_status/8)*8);
-        //creats the new footer for the coalesd blocks
-	blockHeader *newFreeBlockFooter = (void*) previousHeader + 
-		((previousHeader->size_status/8)*8) - 4;
-	//upddates that new footer
-	newFreeBlockFooter->size_status = ((previousHeader->size_status/8)*8);
-        //if we already coalesed backwards we only 
-	//want to update the size_status once
-	if(hasBeenCoalescedBack == 0) {
-	    freeBlockHeader->size_status = freeBlockHeader->size_status -1; 
-	}
-    }
-    
-    return 0;
-} 
- 
 /*
  * Function used to initialize the memory allocator.
  * Intended to be called ONLY once by a program.
  * Argument sizeOfRegion: the size of the heap space to be allocated.
+ * The space is shared out evenly over HEAP_OPT_ARENAS arenas.
  * Returns 0 on success.
  * Returns -1 on failure.
  */                    
-int initHeap(int sizeOfRegion) {    
+int initHeap(size_t sizeOfRegion) {    
  
     static int allocated_once = 0; //prevent multiple initHeap calls
  
-    int pagesize;  // page size
-    int padsize;   // size of padding when heap size not a multiple of page size
+    size_t pagesize;  // page size
+    size_t padsize;   // size of padding when heap size not a multiple of page size
     void* mmap_ptr; // pointer to memory mapped area
     int fd;
-
-    blockHeader* endMark;
+    int i;
   
     if (0 != allocated_once) {
         fprintf(stderr, 
         "Error:mem.c: InitHeap has allocated space during a previous call\n");
         return -1;
     }
-    if (sizeOfRegion <= 0) {
+    if (sizeOfRegion == 0 || sizeOfRegion > MAX_REQUEST) {
         fprintf(stderr, "Error:mem.c: Requested block size is not positive\n");
         return -1;
     }
 
     // Get the pagesize
     pagesize = getpagesize();
+    pageSize = pagesize;
+
+    // With huge pages every arena is made of whole huge pages
+    if (hugePages != HEAP_HUGE_NONE) {
+        pagesize = HUGE_SIZE;
+    }
+    trimGranule = pagesize;
 
-    // Calculate padsize as the padding required to round up sizeOfRegion 
-    // to a multiple of pagesize
-    padsize = sizeOfRegion % pagesize;
+    // Calculate padsize as the padding required to round up each arena's
+    // share of sizeOfRegion to a multiple of pagesize
+    arenaSpan = sizeOfRegion / numArenas + (sizeOfRegion % numArenas != 0);
+    padsize = arenaSpan % pagesize;
     padsize = (pagesize - padsize) % pagesize;
 
-    allocsize = sizeOfRegion + padsize;
+    arenaSpan += padsize;
+    allocsize = arenaSpan;
 
-    // Using mmap to allocate memory
-    fd = open("/dev/zero", O_RDWR);
-    if (-1 == fd) {
-        fprintf(stderr, "Error:mem.c: Cannot open /dev/zero\n");
+    // Thread caches hand their blocks back when their thread exits
+    if (threadSafe && 0 != pthread_key_create(&tcacheKey, flushThreadCache)) {
+        fprintf(stderr, "Error:mem.c: Cannot create thread cache key\n");
         return -1;
     }
-    mmap_ptr = mmap(NULL, allocsize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (threadSafe && cpuCacheWanted) {
+        cpuCaches = mapCpuCaches();
+    }
+
+    // Using mmap to allocate memory
+    if (hugePages != HEAP_HUGE_NONE) {
+        mmap_ptr = mapHuge(arenaSpan * numArenas);
+        if (NULL == mmap_ptr) {
+            mmap_ptr = MAP_FAILED;
+        }
+    } else {
+        fd = open("/dev/zero", O_RDWR);
+        if (-1 == fd) {
+            fprintf(stderr, "Error:mem.c: Cannot open /dev/zero\n");
+            return -1;
+        }
+        mmap_ptr = mmap(NULL, arenaSpan * numArenas, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE, fd, 0);
+    }
     if (MAP_FAILED == mmap_ptr) {
         fprintf(stderr, "Error:mem.c: mmap cannot allocate space\n");
         allocated_once = 0;
@@ -358,63 +4002,34 @@ int initHeap(int sizeOfRegion) {
     allocated_once = 1;
 
     // for double word alignment and end mark
-    allocsize -= 8;
-
-    // Initially there is only one big free block in the heap.
-    // Skip first 4 bytes for double word alignment requirement.
-    heapStart = (blockHeader*) mmap_ptr + 1;
-
-    // Set the end mark
-    endMark = (blockHeader*)((void*)heapStart + allocsize);
-    endMark->size_status = 1;
-
-    // Set size in header
-    heapStart->size_status = allocsize;
-
-    // Set p-bit as allocated in header
-    // note a-bit left at 0 for free
-    heapStart->size_status += 2;
+    allocsize -= ALIGNMENT;
 
-    // Set the footer
-    blockHeader *footer = (blockHeader*) ((void*)heapStart + allocsize - 4);
-    footer->size_status = allocsize;
+    regionStart = mmap_ptr;
+    directCookie = ((uintptr_t)mmap_ptr * 2654435761u) ^ getpid();
+    for (i = 0; i < numArenas; i++) {
+        initArena(&arenas[i], regionStart + i * arenaSpan);
+    }
+    heapStart = arenas[0].first.start;
   
     return 0;
 } 
                   
-/* 
- * Function to be used for DEBUGGING to help you visualize your heap structure.
- * Prints out a list of all the blocks including this information:
- * No.      : serial number of the block 
- * Status   : free/used (allocated)
- * Prev     : status of previous block free/used (allocated)
- * t_Begin  : address of the first byte in the block (where the header starts) 
- * t_End    : address of the last byte in the block 
- * t_Size   : size of the block as stored in the block header
- */                     
-void dumpMem() {     
- 
-    int counter;
+/*
+ * Prints the blocks of one segment for dumpMem, numbering them from
+ * *counter on and adding their sizes to *used_size and *free_size.
+ */
+static void dumpSegment(heapSegment *segment, int *counter, size_t *used_size,
+        size_t *free_size) {
     char status[5];
     char p_status[5];
     char *t_begin = NULL;
     char *t_end   = NULL;
-    int t_size;
-
-    blockHeader *current = heapStart;
-    counter = 1;
+    size_t t_size;
 
-    int used_size = 0;
-    int free_size = 0;
+    blockHeader *current = segment->start;
     int is_used   = -1;
 
-    fprintf(stdout, "************************************Block list***\
-                    ********************************\n");
-    fprintf(stdout, "No.\tStatus\tPrev\tt_Begin\t\tt_End\t\tt_Size\n");
-    fprintf(stdout, "-------------------------------------------------\
-                    --------------------------------\n");
-    int breaker = 0; 
-    while (current->size_status != 1) {
+    while (blockSize(current) != 0) {
         t_begin = (char*)current;
         t_size = current->size_status;
     
@@ -436,34 +4051,344 @@ void dumpMem() {
         }
 
         if (is_used) 
-            used_size += t_size;
+            *used_size += t_size;
         else 
-            free_size += t_size;
+            *free_size += t_size;
 
         t_end = t_begin + t_size - 1;
     
-        fprintf(stdout, "%d\t%s\t%s\t0x%08lx\t0x%08lx\t%d\n", counter, status, 
-        p_status, (unsigned long int)t_begin, (unsigned long int)t_end, t_size);
+        fprintf(stdout, "%d\t%s\t%s\t0x%08lx\t0x%08lx\t%zu\n", *counter,
+                status, p_status, (unsigned long int)t_begin,
+                (unsigned long int)t_end, t_size);
     
         current = (blockHeader*)((char*)current + t_size);
-        counter = counter + 1;
-	breaker++;
-	if (breaker > 15) {
-	    printf("%s","exiting while loop");
-	    current->size_status = 1;
-	}
+        *counter = *counter + 1;
+    }
+}
+                  
+/*
+ * Prints the blocks of a buddy pool for dumpMem like dumpSegment does.
+ */
+static void dumpBuddyPool(buddyPool *pool, int *counter, size_t *used_size,
+        size_t *free_size) {
+    size_t offset;
+    int prevUsed = 1;
+    for (offset = 0; offset < pool->size; ) {
+        int order = buddyOrderAt(pool, offset);
+        size_t t_size = buddySize(order);
+        int is_used = !testBit(pool->freeBits[order], buddyBit(offset, order));
+
+        if (is_used) 
+            *used_size += t_size;
+        else 
+            *free_size += t_size;
+
+        fprintf(stdout, "%d\t%s\t%s\t0x%08lx\t0x%08lx\t%zu\n", *counter,
+                is_used ? "used" : "Free", prevUsed ? "used" : "Free",
+                (unsigned long int)(pool->base + offset),
+                (unsigned long int)(pool->base + offset + t_size - 1), t_size);
+
+        prevUsed = is_used;
+        offset += t_size;
+        *counter = *counter + 1;
+    }
+}
+
+/* 
+ * Function to be used for DEBUGGING to help you visualize your heap structure.
+ * Prints out a list of all the blocks including this information:
+ * No.      : serial number of the block 
+ * Status   : free/used (allocated)
+ * Prev     : status of previous block free/used (allocated)
+ * t_Begin  : address of the first byte in the block (where the header starts) 
+ * t_End    : address of the last byte in the block 
+ * t_Size   : size of the block as stored in the block header
+ * Blocks are listed arena by arena and segment by segment.
+ */                     
+void dumpMem() {     
+ 
+    int counter;
+    int i;
+    heapSegment *segment;
+
+    counter = 1;
+
+    size_t used_size = 0;
+    size_t free_size = 0;
+    size_t quick_size = 0;
+
+    fprintf(stdout, "************************************Block list***\
+                    ********************************\n");
+    fprintf(stdout, "No.\tStatus\tPrev\tt_Begin\t\tt_End\t\tt_Size\n");
+    fprintf(stdout, "-------------------------------------------------\
+                    --------------------------------\n");
+    for (i = 0; i < numArenas; i++) {
+        lockArena(&arenas[i]);
+        if (numArenas > 1) {
+            fprintf(stdout, "Arena %d\n", i);
+        }
+        if (buddyEngine) {
+            dumpBuddyPool(&arenas[i].buddy, &counter, &used_size, &free_size);
+            unlockArena(&arenas[i]);
+            continue;
+        }
+        for (segment = &arenas[i].first; segment; segment = segment->next) {
+            if (segment != &arenas[i].first) {
+                fprintf(stdout, "Segment 0x%08lx\n",
+                        (unsigned long int)segment);
+            }
+            dumpSegment(segment, &counter, &used_size, &free_size);
+        }
+        quick_size += arenas[i].quickBytes;
+        unlockArena(&arenas[i]);
     }
 
     fprintf(stdout, "---------------------------------------------------\
                     ------------------------------\n");
     fprintf(stdout, "***************************************************\
                     ******************************\n");
-    fprintf(stdout, "Total used size = %d\n", used_size);
-    fprintf(stdout, "Total free size = %d\n", free_size);
-    fprintf(stdout, "Total size = %d\n", used_size + free_size);
+    fprintf(stdout, "Total used size = %zu\n", used_size);
+    fprintf(stdout, "Total free size = %zu\n", free_size);
+    fprintf(stdout, "Total size = %zu\n", used_size + free_size);
+    if (directMapped != 0) {
+        fprintf(stdout, "Total mapped size = %zu\n", directMapped);
+    }
+    if (slabMapped != 0) {
+        fprintf(stdout, "Total slab size = %zu\n", slabMapped);
+    }
+    if (quick_size != 0) {
+        fprintf(stdout, "Total quick size = %zu\n", quick_size);
+    }
     fprintf(stdout, "***************************************************\
                     ******************************\n");
     fflush(stdout);
 
     return;  
 } 
+
+#ifdef HEAP_MALLOC
+#pragma GCC visibility pop
+
+/*
+ * The malloc family. libheap.so exports the standard allocation functions
+ * on top of a heap of its own, so existing programs run on it under
+ * LD_PRELOAD without being rebuilt. That heap is set up by the first call
+ * into any of them: thread safe, one arena per CPU, growing on demand,
+ * serving small requests from slabs and mapping large ones directly.
+ * Small blocks are parked on quick lists rather than coalesced at once.
+ * HEAP_* environment variables override these defaults, see heapAlloc.h.
+ */
+#define MALLOC_ARENA_SIZE       CHUNK_SIZE
+#define MALLOC_GROW_SIZE        (4 * CHUNK_SIZE)
+#define MALLOC_MMAP_THRESHOLD   (256 * 1024)
+#define MALLOC_TRIM_THRESHOLD   (16 * CHUNK_SIZE)
+#define MALLOC_QUICK_BUDGET     (64 * 1024)
+
+static const struct {
+    const char *name;
+    int option;
+} mallocEnv[] = {
+    {"HEAP_ARENAS",         HEAP_OPT_ARENAS},
+    {"HEAP_ARENA_BY_CPU",   HEAP_OPT_ARENA_BY_CPU},
+    {"HEAP_CPU_CACHE",      HEAP_OPT_CPU_CACHE},
+    {"HEAP_GROW_SIZE",      HEAP_OPT_GROW_SIZE},
+    {"HEAP_TRIM_THRESHOLD", HEAP_OPT_TRIM_THRESHOLD},
+    {"HEAP_TRIM_LAZY",      HEAP_OPT_TRIM_LAZY},
+    {"HEAP_MMAP_THRESHOLD", HEAP_OPT_MMAP_THRESHOLD},
+    {"HEAP_SLAB_LIMIT",     HEAP_OPT_SLAB_LIMIT},
+    {"HEAP_QUICK_BUDGET",   HEAP_OPT_QUICK_BUDGET},
+    {"HEAP_POLICY",         HEAP_OPT_POLICY},
+    {"HEAP_ENGINE",         HEAP_OPT_ENGINE},
+    {"HEAP_HUGE_PAGES",     HEAP_OPT_HUGE_PAGES},
+};
+
+static pthread_once_t mallocOnce = PTHREAD_ONCE_INIT;
+static int mallocReady = 0;
+
+/*
+ * Sets up the heap behind the malloc family, run once by pthread_once.
+ */
+static void initMallocHeap() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t size;
+    char *value;
+    size_t i;
+
+    heapSetOption(HEAP_OPT_THREAD_SAFE, 1);
+    heapSetOption(HEAP_OPT_ARENAS, 
+            cpus < 1 ? 1 : cpus < MAX_ARENAS ? cpus : MAX_ARENAS);
+    heapSetOption(HEAP_OPT_GROW_SIZE, MALLOC_GROW_SIZE);
+    heapSetOption(HEAP_OPT_MMAP_THRESHOLD, MALLOC_MMAP_THRESHOLD);
+    heapSetOption(HEAP_OPT_TRIM_THRESHOLD, MALLOC_TRIM_THRESHOLD);
+    heapSetOption(HEAP_OPT_TRIM_LAZY, 1);
+    heapSetOption(HEAP_OPT_SLAB_LIMIT, SLAB_MAX);
+    heapSetOption(HEAP_OPT_QUICK_BUDGET, MALLOC_QUICK_BUDGET);
+    for (i = 0; i < sizeof(mallocEnv) / sizeof(mallocEnv[0]); i++) {
+        value = getenv(mallocEnv[i].name);
+        if (value != NULL) {
+            heapSetOption(mallocEnv[i].option, strtol(value, NULL, 0));
+        }
+    }
+    value = getenv("HEAP_SIZE");
+    size = value != NULL ? strtoul(value, NULL, 0) :
+            (size_t)numArenas * MALLOC_ARENA_SIZE;
+    if (initHeap(size) != 0) {
+        return;
+    }
+    __atomic_store_n(&mallocReady, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Makes sure the heap behind the malloc family exists.
+ * Returns 1 if it does, 0 if it could not be set up.
+ */
+static inline int mallocHeapReady() {
+    if (__atomic_load_n(&mallocReady, __ATOMIC_ACQUIRE)) {
+        return 1;
+    }
+    pthread_once(&mallocOnce, initMallocHeap);
+    return __atomic_load_n(&mallocReady, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Allocates size bytes whose address is a multiple of align, a power of
+ * two, with allocHeapAligned.
+ * Returns the payload or NULL on failure.
+ */
+static void *allocAligned(size_t align, size_t size) {
+    if (!mallocHeapReady()) {
+        return NULL;
+    }
+    return allocHeapAligned(size != 0 ? size : 1, align);
+}
+
+void *malloc(size_t size) {
+    void *ptr = mallocHeapReady() ? allocHeap(size != 0 ? size : 1) : NULL;
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+void free(void *ptr) {
+    if (ptr != NULL) {
+        freeHeap(ptr);
+    }
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    size_t total;
+    if (__builtin_mul_overflow(nmemb, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    void *ptr = malloc(total);
+    //blocks with a mapping of their own come zeroed from the kernel
+    if (ptr != NULL && (ownerArena(ptr) != NULL || slabOf(ptr) != NULL)) {
+        memset(ptr, 0, total);
+    }
+    return ptr;
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return malloc(size);
+    }
+    void *moved = reallocHeap(ptr, size);
+    if (moved == NULL && size != 0) {
+        errno = ENOMEM;
+    }
+    return moved;
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0 ||
+            alignment % sizeof(void*) != 0) {
+        return EINVAL;
+    }
+    void *ptr = allocAligned(alignment, size);
+    if (ptr == NULL) {
+        return ENOMEM;
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    void *ptr = allocAligned(alignment, size);
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+void *memalign(size_t alignment, size_t size) {
+    return aligned_alloc(alignment, size);
+}
+
+void *valloc(size_t size) {
+    return aligned_alloc(getpagesize(), size);
+}
+
+void *pvalloc(size_t size) {
+    size_t pagesize = getpagesize();
+    if (size > MAX_REQUEST) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return aligned_alloc(pagesize, (size + pagesize - 1) & ~(pagesize - 1));
+}
+
+size_t malloc_usable_size(void *ptr) {
+    if (ptr == NULL) {
+        return 0;
+    }
+    if (ownerArena(ptr) == NULL) {
+        slabHeader *slab = slabOf(ptr);
+        if (slab != NULL) {
+            return slabIndex(slab, ptr) < 0 ? 0 : slab->objSize;
+        }
+        blockHeader *header = directHeader(ptr);
+        return header == NULL ? 0 : blockSize(header) - directOffset(ptr);
+    }
+    if (buddyEngine) {
+        heapArena *arena = ownerArena(ptr);
+        lockArena(arena);
+        int order = buddyOrderAt(&arena->buddy, (char*)ptr - arena->buddy.base);
+        unlockArena(arena);
+        return order < 0 ? 0 : buddySize(order);
+    }
+    //the p-bit may be flipped under our feet, the size never is
+    blockHeader *header = (blockHeader*)ptr - 1;
+    return (__atomic_load_n(&header->size_status, __ATOMIC_RELAXED) & 
+            SIZE_MASK) - sizeof(blockHeader);
+}
+#endif // HEAP_MALLOC
+
+/*
+ * A forked child gets a copy of the arenas but only of the calling
+ * thread, so none of their locks may be held by another thread at the
+ * time of the fork.
+ */
+static void lockAllArenas() {
+    int i;
+    for (i = 0; i < numArenas; i++) {
+        lockArena(&arenas[i]);
+    }
+}
+
+static void unlockAllArenas() {
+    int i;
+    for (i = numArenas - 1; i >= 0; i--) {
+        unlockArena(&arenas[i]);
+    }
+}
+
+__attribute__((constructor))
+static void registerForkHandlers() {
+    pthread_atfork(lockAllArenas, unlockAllArenas, unlockAllArenas);
+}
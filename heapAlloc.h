@@ -8,13 +8,216 @@
 #ifndef __heapAlloc_h
 #define __heapAlloc_h
 
-int   initHeap (int sizeOfRegion);
-void* allocHeap(int size);
+#include <stddef.h>
+
+int   initHeap (size_t sizeOfRegion);
+void* allocHeap(size_t size);
 int   freeHeap (void *ptr);
+void* reallocHeap(void *ptr, size_t size);
+void* allocHeapAligned(size_t size, size_t align);
 void  dumpMem  ();
+size_t allocHeapBatch(size_t size, size_t n, void **out);
+int   freeHeapBatch (void **ptrs, size_t n);
+
+/*
+ * Options for heapSetOption. Unless noted they must be set before initHeap.
+ *   HEAP_OPT_THREAD_SAFE:  non-zero lets allocHeap/freeHeap be called from
+ *                          several threads at once.
+ *   HEAP_OPT_ARENAS:       number of independent arenas (1 to 64) the heap
+ *                          is split into, each with its own lock.
+ *   HEAP_OPT_ARENA_BY_CPU: non-zero picks a thread's arena from the CPU it
+ *                          runs on instead of handing arenas out
+ *                          round-robin.
+ *   HEAP_OPT_CPU_CACHE:    non-zero replaces the thread caches of
+ *                          thread-safe mode with one cache per CPU, driven
+ *                          by restartable sequences, so that cached
+ *                          memory grows with the cores rather than the
+ *                          threads. Only takes effect in x86-64 builds
+ *                          against glibc 2.35 or later on kernels with
+ *                          rseq, and keeps the thread caches otherwise.
+ *   HEAP_OPT_GROW_SIZE:    when non-zero, an arena that runs out of space
+ *                          maps another segment of at least this many
+ *                          bytes instead of failing. 0 (the default) keeps
+ *                          the heap at its initHeap size.
+ *   HEAP_OPT_TRIM_THRESHOLD: when non-zero, an arena returns the free pages
+ *                          inside its large free blocks to the kernel each
+ *                          time it has freed this many bytes. 0 (the
+ *                          default) only trims on heapTrim. May be changed
+ *                          at any time.
+ *   HEAP_OPT_TRIM_LAZY:    non-zero trims with MADV_FREE, which lets the
+ *                          kernel reclaim the pages only under memory
+ *                          pressure, instead of MADV_DONTNEED. May be
+ *                          changed at any time.
+ *   HEAP_OPT_MMAP_THRESHOLD: when non-zero, requests of at least this many
+ *                          bytes get a mapping of their own that freeHeap
+ *                          unmaps again. 0 (the default) serves every
+ *                          request from the arenas. May be changed at any
+ *                          time.
+ *   HEAP_OPT_SLAB_LIMIT:   requests of up to this many bytes (at most 512)
+ *                          are served from slabs, pages of equal objects
+ *                          without headers that are mapped apart from the
+ *                          heap. 0 (the default) keeps small requests in
+ *                          the blocks. May be changed at any time.
+ *   HEAP_OPT_QUICK_BUDGET: when non-zero, freed blocks of less than
+ *                          1 KiB (512 bytes in 32-bit builds) are parked
+ *                          uncoalesced on per-size quick lists, up to
+ *                          this many bytes per arena, for allocHeap to
+ *                          reuse. Going over it, or running out of space,
+ *                          coalesces all of them. 0 (the default) coalesces
+ *                          every free right away. May be changed at any
+ *                          time.
+ *   HEAP_OPT_POLICY:       placement policy used to pick the free block a
+ *                          request is carved from, one of the
+ *                          HEAP_POLICY_ constants below.
+ *   HEAP_OPT_ENGINE:       how the arenas are managed, one of the
+ *                          HEAP_ENGINE_ constants below.
+ *   HEAP_OPT_HUGE_PAGES:   whether the arenas are backed by 2 MiB huge
+ *                          pages, one of the HEAP_HUGE_ constants below.
+ */
+#define HEAP_OPT_THREAD_SAFE    1
+#define HEAP_OPT_ARENAS         2
+#define HEAP_OPT_ARENA_BY_CPU   3
+#define HEAP_OPT_GROW_SIZE      4
+#define HEAP_OPT_TRIM_THRESHOLD 5
+#define HEAP_OPT_TRIM_LAZY      6
+#define HEAP_OPT_MMAP_THRESHOLD 7
+#define HEAP_OPT_SLAB_LIMIT     8
+#define HEAP_OPT_POLICY         9
+#define HEAP_OPT_ENGINE         10
+#define HEAP_OPT_QUICK_BUDGET   11
+#define HEAP_OPT_HUGE_PAGES     12
+#define HEAP_OPT_CPU_CACHE      13
+
+/*
+ * Placement policies. All of them search the segregated free lists from
+ * the request's size class up.
+ *   HEAP_POLICY_FIRST_FIT: the first block that fits (the default).
+ *   HEAP_POLICY_NEXT_FIT:  the first block that fits after the one the
+ *                          previous search ended at.
+ *   HEAP_POLICY_BEST_FIT:  the smallest block that fits, the lowest
+ *                          addressed one on ties. Large free blocks are
+ *                          kept in a tree so this takes logarithmic time.
+ *   HEAP_POLICY_GOOD_FIT:  the smallest of the first few blocks that fit,
+ *                          or the first one close enough to the request.
+ *   HEAP_POLICY_TLSF:      two-level segregated fit, the head of the first
+ *                          list whose blocks are all big enough. Lookup
+ *                          takes constant time however full the heap is.
+ */
+#define HEAP_POLICY_FIRST_FIT   0
+#define HEAP_POLICY_NEXT_FIT    1
+#define HEAP_POLICY_BEST_FIT    2
+#define HEAP_POLICY_GOOD_FIT    3
+#define HEAP_POLICY_TLSF        4
+
+/*
+ * Engines.
+ *   HEAP_ENGINE_BLOCKS:    blocks of any size with boundary tags, split
+ *                          and coalesced as needed (the default).
+ *   HEAP_ENGINE_BUDDY:     binary buddy system. Blocks are powers of two
+ *                          aligned to their size, so page sized requests
+ *                          get whole pages. Placement policies and arena
+ *                          growth do not apply. The pool is only page
+ *                          aligned, so allocHeapAligned with an alignment
+ *                          past a page only serves requests of up to a
+ *                          page.
+ */
+#define HEAP_ENGINE_BLOCKS      0
+#define HEAP_ENGINE_BUDDY       1
+
+/*
+ * Huge pages. Other than with HEAP_HUGE_NONE, each arena and each grown
+ * segment spans whole 2 MiB huge pages and is aligned to one, and trimming
+ * only releases whole huge pages so that it never splits one up.
+ *   HEAP_HUGE_NONE:        normal pages (the default).
+ *   HEAP_HUGE_TRANSPARENT: asks the kernel for transparent huge pages
+ *                          with MADV_HUGEPAGE.
+ *   HEAP_HUGE_TLB:         takes huge pages reserved with hugetlbfs
+ *                          through MAP_HUGETLB, falling back to transparent
+ *                          huge pages when there are not enough.
+ * Either way the heap quietly keeps normal pages if the kernel has no
+ * huge pages to give.
+ */
+#define HEAP_HUGE_NONE          0
+#define HEAP_HUGE_TRANSPARENT   1
+#define HEAP_HUGE_TLB           2
+
+int   heapSetOption(int option, long value);
+size_t heapTrim    ();
+
+/*
+ * Bump arenas, for objects that are all freed together. arenaAlloc moves
+ * a pointer through chunks taken from the heap, arenaReset frees every
+ * object at once in constant time and keeps the chunks for reuse, and
+ * arenaDestroy hands the chunks back. Objects from an arena must not be
+ * passed to freeHeap, and an arena must not be used by several threads
+ * at once.
+ */
+typedef struct bumpArena arena_t;
+
+arena_t* arenaCreate (size_t chunkSize);
+void*    arenaAlloc  (arena_t *arena, size_t size);
+void     arenaReset  (arena_t *arena);
+void     arenaDestroy(arena_t *arena);
+
+/*
+ * Heaps of their own, isolated from the heap of initHeap and from each
+ * other. heapCreate maps one with a single arena of at least size bytes
+ * that never grows, heapAllocFrom and heapFreeTo work like allocHeap and
+ * freeHeap on it, and heapDestroy unmaps it with every block still in it.
+ * Blocks of such a heap must not be passed to freeHeap or reallocHeap.
+ */
+typedef struct heapHandle heap_t;
+
+heap_t* heapCreate   (size_t size);
+void*   heapAllocFrom(heap_t *heap, size_t size);
+int     heapFreeTo   (heap_t *heap, void *ptr);
+void    heapDestroy  (heap_t *heap);
+
+/*
+ * Heaps kept in files. heapOpen maps a heap file MAP_SHARED, creating it
+ * if needed, and the heap works like one of heapCreate until heapClose
+ * writes it back. Reopening the file brings back every block as it was,
+ * along with the root block of heapSetRoot. The heap may come back at
+ * another address, so pointers stored in it should be heapOffsetOf
+ * offsets that heapPointerAt turns back into pointers.
+ */
+heap_t* heapOpen     (const char *path, size_t size);
+int     heapClose    (heap_t *heap);
+size_t  heapOffsetOf (heap_t *heap, void *ptr);
+void*   heapPointerAt(heap_t *heap, size_t offset);
+void    heapSetRoot  (heap_t *heap, void *ptr);
+void*   heapGetRoot  (heap_t *heap);
+
+/*
+ * Heaps shared between processes. heapShare creates the named POSIX shared
+ * memory object, or attaches to the heap in it, and every process maps it
+ * at the same address. A block allocated in one process can be read and
+ * freed in another, passed along as a heapOffsetOf offset. The heap has a
+ * process-shared lock. heapDetach unmaps it from the calling process and
+ * shm_unlink removes it.
+ */
+heap_t* heapShare    (const char *name, size_t size);
+void    heapDetach   (heap_t *heap);
 
-void* malloc(size_t size) {
-    return NULL;
-}
+/*
+ * libheap.so also exports malloc, free, calloc, realloc, posix_memalign,
+ * aligned_alloc, memalign, valloc, pvalloc and malloc_usable_size, so it
+ * can be LD_PRELOADed under existing programs. They share one heap that is
+ * set up on first use: thread safe, one arena per CPU, growing in 4 MiB
+ * segments, trimming lazily every 16 MiB freed, serving requests of up to
+ * 512 bytes from slabs, parking up to 64 KiB of small freed blocks per
+ * arena on quick lists and mapping requests of 256 KiB and up directly.
+ * These environment variables change that setup:
+ *   HEAP_SIZE              initial size of the heap, 1 MiB per arena
+ *   HEAP_ARENAS, HEAP_ARENA_BY_CPU, HEAP_GROW_SIZE, HEAP_TRIM_THRESHOLD,
+ *   HEAP_TRIM_LAZY, HEAP_MMAP_THRESHOLD, HEAP_SLAB_LIMIT, HEAP_POLICY,
+ *   HEAP_ENGINE, HEAP_QUICK_BUDGET, HEAP_HUGE_PAGES, HEAP_CPU_CACHE
+ *                          value of the HEAP_OPT_ option of the same name
+ * The heap behind the malloc family is separate from the one initHeap
+ * sets up, and neither sees the other's options. A program may call
+ * initHeap before or after its first malloc, printf and the C library
+ * included, but a block must go back to the family it came from: free
+ * takes nothing from allocHeap and freeHeap nothing from malloc.
+ */
 
 #endif // __heapAlloc_h__